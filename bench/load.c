@@ -0,0 +1,577 @@
+// Load generator for the dumdb HTTP API. Drives insertOne, findOne, deleteOne or a mix of them from many
+// concurrent keep-alive connections against a running server and prints throughput and latency percentiles as JSON.
+//
+//   clang -O2 -o build/dumdb_load bench/load.c -lpthread -lm && build/dumdb_load --workload mixed --connections 32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define ID_LENGTH 24
+#define RESPONSE_BUFFER_SIZE 4096
+
+typedef enum
+{
+  WORKLOAD_INSERT,
+  WORKLOAD_FIND,
+  WORKLOAD_DELETE,
+  WORKLOAD_MIXED
+} ddb_workload;
+
+static const char *workload_names[] = {"insert", "find", "delete", "mixed"};
+
+typedef enum
+{
+  OPERATION_INSERT,
+  OPERATION_FIND,
+  OPERATION_DELETE
+} ddb_operation;
+
+typedef struct
+{
+  const char *host;
+  const char *port;
+  ddb_workload workload;
+  int connections;
+  long requests;       // Measured requests, shared by all connections
+  long preload;        // Documents inserted before measuring, the keys for find and delete
+  size_t document_bytes;
+  double skew;         // Zipf exponent for picking keys, 0 picks them uniformly
+  int mix[3];          // Percent of insert, find and delete for the mixed workload
+  uint64_t seed;
+  bool reset;
+} ddb_load_options;
+
+static ddb_load_options options = {"127.0.0.1", "8080", WORKLOAD_FIND, 16, 10000, 1000, 100, 0, {10, 80, 10}, 1, false};
+
+static struct addrinfo *server_address;
+
+// The _ids of the preloaded documents, and cumulative probabilities for picking them
+static char (*keys)[ID_LENGTH + 1];
+static double *key_cdf;
+
+// Handed out one at a time, so no two requests delete the same document and the run stops after options.requests
+static long next_request;
+static long next_delete;
+
+typedef struct
+{
+  pthread_t thread;
+  uint64_t random_state;
+  uint64_t *latencies; // Nanoseconds, one per request
+  long count;
+  long capacity;
+  long errors;
+  long not_found;
+} ddb_worker;
+
+static uint64_t monotonic_nanoseconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// xorshift64*, every worker has its own state so runs with the same seed pick the same keys
+static uint64_t next_random(uint64_t *state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ull;
+}
+
+static double next_random_fraction(uint64_t *state)
+{
+  return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void build_key_cdf(long num_keys, double skew)
+{
+  key_cdf = malloc(sizeof(double) * num_keys);
+  double total = 0;
+  for (long i = 0; i < num_keys; i++)
+  {
+    total += 1.0 / pow((double)(i + 1), skew);
+    key_cdf[i] = total;
+  }
+  for (long i = 0; i < num_keys; i++)
+  {
+    key_cdf[i] /= total;
+  }
+}
+
+// Key 0 is the hottest when skew > 0
+static const char *pick_key(uint64_t *random_state, long num_keys)
+{
+  double fraction = next_random_fraction(random_state);
+  long low = 0;
+  long high = num_keys - 1;
+  while (low < high)
+  {
+    long middle = (low + high) / 2;
+    if (key_cdf[middle] < fraction)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return keys[low];
+}
+
+// Every thread keeps one connection open to the server and reuses it for all its requests, -1 until connected
+static __thread int connection = -1;
+
+static void close_connection()
+{
+  if (connection >= 0)
+  {
+    close(connection);
+    connection = -1;
+  }
+}
+
+static bool open_connection()
+{
+  connection = socket(server_address->ai_family, server_address->ai_socktype, server_address->ai_protocol);
+  if (connection < 0)
+  {
+    return false;
+  }
+  int one = 1;
+  setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(connection, server_address->ai_addr, server_address->ai_addrlen) != 0)
+  {
+    close_connection();
+    return false;
+  }
+  return true;
+}
+
+static ssize_t receive(char *into, size_t space)
+{
+  for (;;)
+  {
+    ssize_t received = recv(connection, into, space, 0);
+    if (received >= 0 || errno != EINTR)
+    {
+      return received;
+    }
+  }
+}
+
+// Finds a header in the response, case insensitively since the name's case is up to the server
+static const char *find_header(const char *headers, const char *name)
+{
+  size_t name_length = strlen(name);
+  for (const char *line = strstr(headers, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n"))
+  {
+    if (0 == strncasecmp(line + 2, name, name_length) && line[2 + name_length] == ':')
+    {
+      return line + 2 + name_length + 1;
+    }
+  }
+  return NULL;
+}
+
+// Sends one request on the thread's connection and reads the response by its Content-Length, so the connection
+// can carry the next one. Only the start of the response is kept in response. Returns the HTTP status, or -1 if
+// the request failed. *received_any tells whether any of the response arrived before a failure
+static int post_on_connection(const char *path, const char *body, size_t body_length, char *response, size_t response_capacity,
+                              bool *received_any)
+{
+  *received_any = false;
+  char header[256];
+  int header_length = snprintf(header, sizeof(header),
+                               "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+                               path, options.host, body_length);
+  if (send(connection, header, header_length, MSG_NOSIGNAL) != header_length ||
+      send(connection, body, body_length, MSG_NOSIGNAL) != (ssize_t)body_length)
+  {
+    return -1;
+  }
+  size_t length = 0;
+  char *headers_end = NULL;
+  while (headers_end == NULL)
+  {
+    ssize_t received = length + 1 < response_capacity ? receive(response + length, response_capacity - length - 1) : -1;
+    if (received <= 0)
+    {
+      return -1;
+    }
+    *received_any = true;
+    length += received;
+    response[length] = '\0';
+    headers_end = strstr(response, "\r\n\r\n");
+  }
+  int status = -1;
+  const char *content_length = find_header(response, "Content-Length");
+  if (sscanf(response, "HTTP/%*s %d", &status) != 1 || content_length == NULL)
+  {
+    return -1;
+  }
+  size_t remaining_length = strtoull(content_length, NULL, 10);
+  size_t body_received = length - (headers_end + 4 - response);
+  if (body_received > remaining_length)
+  {
+    // The server only answers what was asked, anything beyond the body means the connection is out of step
+    return -1;
+  }
+  remaining_length -= body_received;
+  const char *connection_header = find_header(response, "Connection");
+  bool keep_alive = connection_header == NULL || NULL == strstr(connection_header, "close");
+  char discard[RESPONSE_BUFFER_SIZE];
+  while (remaining_length > 0)
+  {
+    bool keep = length + 1 < response_capacity;
+    char *into = keep ? response + length : discard;
+    size_t space = keep ? response_capacity - length - 1 : sizeof(discard);
+    ssize_t received = receive(into, space < remaining_length ? space : remaining_length);
+    if (received <= 0)
+    {
+      return -1;
+    }
+    remaining_length -= received;
+    if (keep)
+    {
+      length += received;
+      response[length] = '\0';
+    }
+  }
+  if (!keep_alive)
+  {
+    close_connection();
+  }
+  return status;
+}
+
+// Returns the HTTP status, or -1 if the request failed. A kept connection the server closed while idle is opened
+// again, but only when none of the response arrived, so an insert is never sent twice after the server handled it
+static int post(const char *path, const char *body, size_t body_length, char *response, size_t response_capacity)
+{
+  response[0] = '\0';
+  bool reused = connection >= 0;
+  if (!reused && !open_connection())
+  {
+    return -1;
+  }
+  bool received_any;
+  int status = post_on_connection(path, body, body_length, response, response_capacity, &received_any);
+  if (status < 0 && reused && !received_any)
+  {
+    close_connection();
+    if (!open_connection())
+    {
+      return -1;
+    }
+    status = post_on_connection(path, body, body_length, response, response_capacity, &received_any);
+  }
+  if (status < 0)
+  {
+    close_connection();
+  }
+  return status;
+}
+
+static size_t make_document(char *document, size_t capacity, uint64_t *random_state)
+{
+  size_t padding = options.document_bytes > 32 ? options.document_bytes - 32 : 0;
+  if (padding + 64 > capacity)
+  {
+    padding = capacity - 64;
+  }
+  int length = snprintf(document, capacity, "{\"k\":%" PRIu64 ",\"pad\":\"", next_random(random_state) % 1000000);
+  memset(document + length, 'x', padding);
+  length += padding;
+  length += snprintf(document + length, capacity - length, "\"}");
+  return length;
+}
+
+// Returns the HTTP status, and the new _id for inserts that succeeded
+static int insert_one(char *document, size_t capacity, uint64_t *random_state, char *_id)
+{
+  char response[RESPONSE_BUFFER_SIZE];
+  size_t length = make_document(document, capacity, random_state);
+  int status = post("/documents/insertOne", document, length, response, sizeof(response));
+  const char *id = strstr(response, "\"_id\": \"");
+  if (status == 200 && id != NULL && _id != NULL)
+  {
+    snprintf(_id, ID_LENGTH + 1, "%.*s", ID_LENGTH, id + strlen("\"_id\": \""));
+  }
+  return status;
+}
+
+static int by_id(const char *path, const char *_id)
+{
+  char body[64];
+  char response[RESPONSE_BUFFER_SIZE];
+  int length = snprintf(body, sizeof(body), "{\"_id\":\"%s\"}", _id);
+  return post(path, body, length, response, sizeof(response));
+}
+
+static ddb_operation pick_operation(uint64_t *random_state)
+{
+  switch (options.workload)
+  {
+  case WORKLOAD_INSERT:
+    return OPERATION_INSERT;
+  case WORKLOAD_FIND:
+    return OPERATION_FIND;
+  case WORKLOAD_DELETE:
+    return OPERATION_DELETE;
+  default:
+  {
+    int percent = (int)(next_random(random_state) % 100);
+    if (percent < options.mix[0])
+    {
+      return OPERATION_INSERT;
+    }
+    return percent < options.mix[0] + options.mix[1] ? OPERATION_FIND : OPERATION_DELETE;
+  }
+  }
+}
+
+static void *worker_thread(void *argument)
+{
+  ddb_worker *worker = argument;
+  size_t document_capacity = options.document_bytes + 128;
+  char *document = malloc(document_capacity);
+  while (__atomic_fetch_add(&next_request, 1, __ATOMIC_RELAXED) < options.requests)
+  {
+    ddb_operation operation = pick_operation(&worker->random_state);
+    int status;
+    uint64_t start = monotonic_nanoseconds();
+    if (operation == OPERATION_INSERT)
+    {
+      status = insert_one(document, document_capacity, &worker->random_state, NULL);
+    }
+    else if (operation == OPERATION_FIND)
+    {
+      status = by_id("/documents/findOne", pick_key(&worker->random_state, options.preload));
+    }
+    else
+    {
+      // Every preloaded document is deleted once, coldest first so the finds of a mixed workload keep hitting.
+      // After that the deletes miss
+      long index = __atomic_fetch_add(&next_delete, 1, __ATOMIC_RELAXED);
+      status = by_id("/documents/deleteOne", index < options.preload ? keys[options.preload - 1 - index] : "ffffffffffffffffffffffff");
+    }
+    uint64_t elapsed = monotonic_nanoseconds() - start;
+    if (status == 404)
+    {
+      worker->not_found++;
+    }
+    else if (status != 200)
+    {
+      worker->errors++;
+    }
+    if (worker->count == worker->capacity)
+    {
+      worker->capacity = worker->capacity > 0 ? worker->capacity * 2 : 1024;
+      worker->latencies = realloc(worker->latencies, sizeof(uint64_t) * worker->capacity);
+    }
+    worker->latencies[worker->count++] = elapsed;
+  }
+  close_connection();
+  free(document);
+  return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_microseconds(const uint64_t *sorted, long count, double percentile)
+{
+  if (count == 0)
+  {
+    return 0;
+  }
+  long index = (long)ceil(percentile / 100 * count) - 1;
+  return sorted[index < 0 ? 0 : index] / 1000.0;
+}
+
+static void print_usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [--host <host>] [--port <port>] [--workload insert|find|delete|mixed] [--connections <n>] [--requests <n>] "
+                  "[--preload <documents>] [--document-bytes <n>] [--skew <zipf exponent>] [--mix <insert%%>,<find%%>,<delete%%>] [--seed <n>] [--reset]\n",
+          program);
+}
+
+static bool parse_workload(const char *name)
+{
+  for (int i = WORKLOAD_INSERT; i <= WORKLOAD_MIXED; i++)
+  {
+    if (0 == strcmp(name, workload_names[i]))
+    {
+      options.workload = (ddb_workload)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char *argv[])
+{
+  for (int i = 1; i < argc; i++)
+  {
+    bool has_value = i + 1 < argc;
+    if (0 == strcmp(argv[i], "--host") && has_value)
+    {
+      options.host = argv[++i];
+    }
+    else if (0 == strcmp(argv[i], "--port") && has_value)
+    {
+      options.port = argv[++i];
+    }
+    else if (0 == strcmp(argv[i], "--workload") && has_value && parse_workload(argv[i + 1]))
+    {
+      i++;
+    }
+    else if (0 == strcmp(argv[i], "--connections") && has_value)
+    {
+      options.connections = atoi(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--requests") && has_value)
+    {
+      options.requests = atol(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--preload") && has_value)
+    {
+      options.preload = atol(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--document-bytes") && has_value)
+    {
+      options.document_bytes = strtoull(argv[++i], NULL, 10);
+    }
+    else if (0 == strcmp(argv[i], "--skew") && has_value)
+    {
+      options.skew = atof(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--mix") && has_value &&
+             3 == sscanf(argv[i + 1], "%d,%d,%d", &options.mix[0], &options.mix[1], &options.mix[2]) && options.mix[0] + options.mix[1] + options.mix[2] == 100)
+    {
+      i++;
+    }
+    else if (0 == strcmp(argv[i], "--seed") && has_value)
+    {
+      options.seed = strtoull(argv[++i], NULL, 10);
+    }
+    else if (0 == strcmp(argv[i], "--reset"))
+    {
+      options.reset = true;
+    }
+    else
+    {
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (options.connections < 1 || options.requests < 1 || (options.preload < 1 && options.workload != WORKLOAD_INSERT))
+  {
+    fprintf(stderr, "--connections and --requests must be at least 1, and --preload too unless the workload is insert\n");
+    return 1;
+  }
+
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int result = getaddrinfo(options.host, options.port, &hints, &server_address);
+  if (result != 0)
+  {
+    fprintf(stderr, "Could not resolve %s:%s: %s\n", options.host, options.port, gai_strerror(result));
+    return 1;
+  }
+
+  char response[RESPONSE_BUFFER_SIZE];
+  if (options.reset && post("/test/reset", "{}", 2, response, sizeof(response)) != 200)
+  {
+    fprintf(stderr, "Could not reset the database at %s:%s\n", options.host, options.port);
+    return 1;
+  }
+
+  // Preloading isn't measured, it only creates the documents to find and delete
+  uint64_t preload_random_state = options.seed * 2654435761u + 1;
+  keys = calloc(options.preload > 0 ? options.preload : 1, sizeof(*keys));
+  size_t document_capacity = options.document_bytes + 128;
+  char *document = malloc(document_capacity);
+  for (long i = 0; i < options.preload; i++)
+  {
+    if (insert_one(document, document_capacity, &preload_random_state, keys[i]) != 200)
+    {
+      fprintf(stderr, "Preloading failed after %ld documents, is the server running at %s:%s?\n", i, options.host, options.port);
+      return 1;
+    }
+  }
+  close_connection();
+  free(document);
+  build_key_cdf(options.preload > 0 ? options.preload : 1, options.skew);
+
+  ddb_worker *workers = calloc(options.connections, sizeof(ddb_worker));
+  uint64_t start = monotonic_nanoseconds();
+  for (int i = 0; i < options.connections; i++)
+  {
+    workers[i].random_state = (options.seed + i + 1) * 0x9E3779B97F4A7C15ull;
+    pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+  }
+  long count = 0;
+  long errors = 0;
+  long not_found = 0;
+  for (int i = 0; i < options.connections; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    count += workers[i].count;
+    errors += workers[i].errors;
+    not_found += workers[i].not_found;
+  }
+  double seconds = (monotonic_nanoseconds() - start) / 1e9;
+
+  uint64_t *latencies = malloc(sizeof(uint64_t) * (count > 0 ? count : 1));
+  long filled = 0;
+  uint64_t total_latency = 0;
+  for (int i = 0; i < options.connections; i++)
+  {
+    for (long j = 0; j < workers[i].count; j++)
+    {
+      total_latency += workers[i].latencies[j];
+    }
+    memcpy(latencies + filled, workers[i].latencies, sizeof(uint64_t) * workers[i].count);
+    filled += workers[i].count;
+    free(workers[i].latencies);
+  }
+  qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+
+  printf("{ \"workload\": \"%s\", \"connections\": %d, \"requests\": %ld, \"preload\": %ld, \"documentBytes\": %zu, \"skew\": %g, "
+         "\"seed\": %" PRIu64 ", \"seconds\": %.3f, \"throughput\": %.1f, \"errors\": %ld, \"notFound\": %ld, "
+         "\"latencyMicroseconds\": { \"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f } }\n",
+         workload_names[options.workload], options.connections, count, options.preload, options.document_bytes, options.skew,
+         options.seed, seconds, count / seconds, errors, not_found,
+         count > 0 ? total_latency / 1000.0 / count : 0.0, percentile_microseconds(latencies, count, 50), percentile_microseconds(latencies, count, 99),
+         percentile_microseconds(latencies, count, 99.9), count > 0 ? latencies[count - 1] / 1000.0 : 0.0);
+
+  free(latencies);
+  free(workers);
+  free(keys);
+  free(key_cdf);
+  freeaddrinfo(server_address);
+  return errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,215 @@
+// Microbenchmarks for the storage primitives, without HTTP: jsmn_stream_parse over database files, jsmn_parse and
+// stringify on request bodies, the startup scan in read_sequence_number and find_one_document hits and misses.
+// The database files are generated deterministically, so numbers from different commits can be compared.
+//
+//   clang -O2 -o build/dumdb_storage_bench bench/storage.c -Iinclude -lpthread && build/dumdb_storage_bench --megabytes 1,100,1000
+
+#define DDB_NO_MAIN
+#include "../src/main.c"
+
+static ddb_collection collection;
+
+static const char *cities[] = {"London", "Paris", "New York", "Sidney", "Berlin", "Tokyo", "Lagos", "Lima"};
+
+// Documents of about 200 bytes with a few types of values, every 16th is deleted. Returns the number of documents
+static uint64_t generate_database(const char *path, uint64_t target_bytes)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+  {
+    fprintf(stderr, "Could not create %s\n", path);
+    exit(1);
+  }
+  uint64_t written = fprintf(file, "[\n");
+  uint64_t documents = 0;
+  char _id[ID_LENGTH + 1];
+  while (written < target_bytes)
+  {
+    generateHexId(documents + 1, _id);
+    written += fprintf(file, "%s{\"s\":%d,\"d\":{\"_id\":\"%s\",\"n\":%" PRIu64 ",\"name\":\"user %" PRIu64 "\",\"city\":\"%s\",\"active\":%s,"
+                             "\"tags\":[\"a\",\"b\",%d],\"address\":{\"street\":\"Main street %" PRIu64 "\",\"zip\":\"%05" PRIu64 "\"},\"pad\":\"%.*s\"}}",
+                       documents > 0 ? ",\n" : "", documents % 16 == 15 ? 0 : 1, _id, documents, documents * 7919 % 100000, cities[documents % 8],
+                       documents % 3 ? "true" : "false", (int)(documents % 10), documents % 500, documents * 31 % 100000, (int)(documents % 64),
+                       "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+    documents++;
+  }
+  fprintf(file, "\n]");
+  fclose(file);
+  return documents;
+}
+
+static void print_result(const char *benchmark, const char *input, uint64_t bytes, uint64_t operations, uint64_t nanoseconds)
+{
+  double seconds = nanoseconds / 1e9;
+  printf("{ \"benchmark\": \"%s\", \"input\": \"%s\", \"bytes\": %" PRIu64 ", \"operations\": %" PRIu64 ", \"seconds\": %.3f, "
+         "\"nanosecondsPerOperation\": %.1f, \"megabytesPerSecond\": %.1f }\n",
+         benchmark, input, bytes, operations, seconds, (double)nanoseconds / operations, bytes * operations / 1e6 / seconds);
+  fflush(stdout);
+}
+
+// Runs the operation until at least a second has passed, and at least once
+#define MEASURE(operations, nanoseconds, ...)                \
+  do                                                         \
+  {                                                          \
+    uint64_t measure_start = monotonic_nanoseconds();        \
+    operations = 0;                                          \
+    do                                                       \
+    {                                                        \
+      __VA_ARGS__;                                           \
+      operations++;                                          \
+      nanoseconds = monotonic_nanoseconds() - measure_start; \
+    } while (nanoseconds < 1000000000u);                     \
+  } while (0)
+
+static void benchmark_stream_parse(const char *path, const char *input, uint64_t file_bytes)
+{
+  static char block[1 << 16];
+  uint64_t operations, nanoseconds;
+  MEASURE(operations, nanoseconds, {
+    jsmn_stream_parser parser;
+    ddb_document_parse_state document_parse_state = {&parser};
+    jsmn_stream_init(&parser, &cbs, &document_parse_state);
+    FILE *file = fopen(path, "r");
+    size_t length;
+    while ((length = fread(block, 1, sizeof(block), file)) > 0)
+    {
+      for (size_t i = 0; i < length; i++)
+      {
+        jsmn_stream_parse(&parser, block[i]);
+        document_parse_state.document_read = false;
+        document_parse_state.pos++;
+      }
+    }
+    fclose(file);
+  });
+  print_result("jsmn_stream_parse", input, file_bytes, operations, nanoseconds);
+}
+
+static void benchmark_startup(const char *input, uint64_t file_bytes)
+{
+  uint64_t operations, nanoseconds;
+  MEASURE(operations, nanoseconds, read_sequence_number(&collection));
+  print_result("read_sequence_number", input, file_bytes, operations, nanoseconds);
+}
+
+static void benchmark_find_one(const char *input, uint64_t file_bytes, uint64_t num_documents)
+{
+  // Every 16th document is deleted, so these are all live. The miss has to scan the whole file
+  struct
+  {
+    const char *name;
+    uint64_t sequence;
+  } lookups[] = {{"find_one_document first", 1}, {"find_one_document middle", num_documents / 2 / 16 * 16 + 1}, {"find_one_document miss", num_documents + 1}};
+  struct HeapString document;
+  heapStringInit(&document);
+  for (size_t i = 0; i < sizeof(lookups) / sizeof(lookups[0]); i++)
+  {
+    char _id[ID_LENGTH + 1];
+    generateHexId(lookups[i].sequence, _id);
+    uint64_t operations, nanoseconds;
+    MEASURE(operations, nanoseconds, find_one_document(&collection, _id, &document));
+    print_result(lookups[i].name, input, file_bytes, operations, nanoseconds);
+  }
+  heapStringFreeContents(&document);
+}
+
+// Request bodies like the ones the handlers get, from a filter to a document with hundreds of fields
+static void make_request_bodies(struct HeapString *bodies, const char **names)
+{
+  names[0] = "filter";
+  heapStringSetToCString(&bodies[0], "{\"_id\":\"000000000000000000000001\"}");
+  names[1] = "small document";
+  heapStringSetToCString(&bodies[1], "{\"name\":\"John Doe\",\"age\":30,\"city\":\"New York\",\"active\":true}");
+  names[2] = "nested document";
+  heapStringSetToCString(&bodies[2], "{\"name\":\"Jane Doe\",\"personal\":{\"hobbies\":[\"Gardening\",\"Curling\"],\"pets\":[{\"name\":\"Rex\",\"age\":4},"
+                                     "{\"name\":\"Tom\",\"age\":7}]},\"scores\":[1,2,3,4,5,6,7,8,9,10],\"address\":{\"street\":\"Main street 1\",\"zip\":\"12345\"}}");
+  names[3] = "400 fields";
+  heapStringSetToCString(&bodies[3], "{");
+  for (int i = 0; i < 400; i++)
+  {
+    heapStringAppendFormat(&bodies[3], "%s\"field%d\":\"value %d\"", i > 0 ? "," : "", i, i * 7);
+  }
+  heapStringAppendString(&bodies[3], "}");
+}
+
+static void benchmark_request_parsing()
+{
+  struct HeapString bodies[4];
+  const char *names[4];
+  for (int i = 0; i < 4; i++)
+  {
+    heapStringInit(&bodies[i]);
+  }
+  make_request_bodies(bodies, names);
+  static jsmntok_t tokens[4096];
+  struct HeapString stringified;
+  heapStringInit(&stringified);
+  for (int i = 0; i < 4; i++)
+  {
+    uint64_t operations, nanoseconds;
+    int num_tokens = 0;
+    MEASURE(operations, nanoseconds, {
+      jsmn_parser parser;
+      jsmn_init(&parser);
+      num_tokens = jsmn_parse(&parser, bodies[i].contents, bodies[i].length, tokens, 4096);
+    });
+    print_result("jsmn_parse", names[i], bodies[i].length, operations, nanoseconds);
+    MEASURE(operations, nanoseconds, {
+      stringified.length = 0;
+      stringify(bodies[i].contents, tokens, num_tokens, 0, &stringified, "_id", "000000000000000000000001");
+    });
+    print_result("stringify", names[i], bodies[i].length, operations, nanoseconds);
+    heapStringFreeContents(&bodies[i]);
+  }
+  heapStringFreeContents(&stringified);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *megabytes = "1,100,1000";
+  const char *directory = ".";
+  for (int i = 1; i < argc; i++)
+  {
+    if (0 == strcmp(argv[i], "--megabytes") && i + 1 < argc)
+    {
+      megabytes = argv[++i];
+    }
+    else if (0 == strcmp(argv[i], "--directory") && i + 1 < argc)
+    {
+      directory = argv[++i];
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [--megabytes <comma separated database sizes>] [--directory <where to generate the databases>]\n", argv[0]);
+      return 1;
+    }
+  }
+  log_level = LOG_ERROR;
+  collection_init(&collection, "bench");
+
+  benchmark_request_parsing();
+
+  for (const char *size = megabytes; *size;)
+  {
+    char *end;
+    uint64_t size_megabytes = strtoull(size, &end, 10);
+    size = *end == ',' ? end + 1 : end;
+    if (size_megabytes == 0)
+    {
+      continue;
+    }
+    char path[1024];
+    char input[64];
+    snprintf(path, sizeof(path), "%s/bench_%" PRIu64 "mb.ddb.json", directory, size_megabytes);
+    snprintf(input, sizeof(input), "%" PRIu64 " MB database", size_megabytes);
+    uint64_t num_documents = generate_database(path, size_megabytes * 1000000);
+    uint64_t file_bytes = get_file_size(path);
+    snprintf(collection.file_name, sizeof(collection.file_name), "%s", path);
+    segments_discover(&collection);
+    benchmark_stream_parse(path, input, file_bytes);
+    benchmark_startup(input, file_bytes);
+    benchmark_find_one(input, file_bytes, num_documents);
+    remove(path);
+  }
+  return 0;
+}
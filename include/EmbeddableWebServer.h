@@ -72,12 +72,14 @@ int main() {
 
 /* Quick nifty options */
 static bool OptionPrintWholeRequest = false;
-/* /status page - makes quite a few things take a lock to update counters but it doesn't make much of a difference. This isn't something like Nginx or Haywire*/
+/* /status page - makes quite a few things update counters but it doesn't make much of a difference. This isn't something like Nginx or Haywire*/
 static bool OptionIncludeStatusPageAndCounters = true;
 /* If using responseAllocServeFileFromRequestPath and no index.html is found, serve up the directory */
 static bool OptionListDirectoryContents = true;
 /* Print the entire server response to every request */
 static bool OptionPrintResponse = false;
+/* Serve more than one request on a connection when the client asks for it (HTTP/1.1 without Connection: close) */
+static bool OptionKeepAlive = true;
 
 /* These bound the memory used by a request. The headers used to be dynamically allocated but I've made them hard coded because: 1. Memory used by a request should be bounded 2. It was responsible for 2 * headersCount allocations every request */
 #define REQUEST_MAX_HEADERS 64
@@ -88,6 +90,8 @@ static bool OptionPrintResponse = false;
 #define SEND_RECV_BUFFER_SIZE (16 * 1024)
 /* contains the Response HTTP status and headers */
 #define RESPONSE_HEADER_SIZE 1024
+/* How long a kept alive connection waits for its next request before it is closed */
+#define KEEP_ALIVE_TIMEOUT_SECONDS 30
 
 #define EMBEDDABLE_WEB_SERVER_VERSION_STRING "1.1.3"
 #define EMBEDDABLE_WEB_SERVER_VERSION 0x00010103 // major = [31:16] minor = [15:8] build = [7:0]
@@ -110,6 +114,7 @@ static bool OptionPrintResponse = false;
 #include <signal.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <stddef.h>
 
 #ifdef WIN32
 #include <WinSock2.h>
@@ -130,6 +135,8 @@ typedef SOCKET sockettype;
 #else // not WIN32 - macOS/Linux
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <pthread.h>
 #include <ifaddrs.h>
@@ -160,6 +167,18 @@ struct HeapString {
     char* contents; // null-terminated, at least length+1
     size_t length; // this is updated by the heapString* functions
     size_t capacity;
+    bool contentsBorrowed; // contents belong to a connection arena. They are copied to the heap if the string grows and never freed
+};
+
+/* A bump allocator for things that live as long as the request. Every connection has one, so building a request
+ and its response doesn't take a malloc for every small piece. Allocations that don't fit go to the heap and are
+ freed when the arena is reset */
+#define ARENA_SIZE (16 * 1024)
+struct ArenaBlock;
+struct Arena {
+    char buffer[ARENA_SIZE];
+    size_t used;
+    struct ArenaBlock* blocks;
 };
 
 /* a string pointing to the request->headerStringPool */
@@ -218,13 +237,22 @@ struct ConnectionStatus {
     int64_t bytesReceived;
 };
 
+/* The buffers a connection only needs while it handles a request. They are taken from a shared pool when a request
+ arrives and given back after the response, so a kept alive connection waiting for its next request doesn't hold them */
+struct ConnectionBuffers {
+    char sendRecvBuffer[SEND_RECV_BUFFER_SIZE];
+    char responseHeader[RESPONSE_HEADER_SIZE];
+    /* the request body and the response are allocated from here */
+    struct Arena arena;
+    /* next buffers in the pool */
+    struct ConnectionBuffers* nextPooled;
+};
+
 /* This contains a full HTTP connection. For every connection, a thread is spawned
  and passed this struct */
 struct Connection {
-    /* Just allocate the buffers in the connection. These go at the beginning of
-     the connection in the hopes that they are 'more aligned' */
-    char sendRecvBuffer[SEND_RECV_BUFFER_SIZE];
-    char responseHeader[RESPONSE_HEADER_SIZE];
+    /* NULL between requests, see connectionBuffersAcquire */
+    struct ConnectionBuffers* buffers;
     sockettype socketfd;
     /* Who connected? */
     struct sockaddr_storage remoteAddr;
@@ -235,6 +263,10 @@ struct Connection {
     struct Request request;
     /* points back to the server, usually used for the server's globalMutex */
     struct Server* server;
+    /* whether the connection stays open for another request after the response to this one */
+    bool keepAlive;
+    /* next connection in the pool of connections waiting to be reused */
+    struct Connection* nextPooled;
 };
 
 /* You create one of these for the server to send. Use one of the responseAlloc functions.
@@ -248,6 +280,8 @@ struct Response {
     char* status;
     char* contentType;
     char* extraHeaders; // can be NULL
+    bool extraHeadersStatic; // extraHeaders outlives the response and isn't freed, see responseSetStaticExtraHeaders
+    bool allocatedInArena; // the response itself, status and contentType are in the connection arena
 };
 
 struct Server {
@@ -255,6 +289,9 @@ struct Server {
     pthread_mutex_t globalMutex;
     bool shouldRun;
     sockettype listenerfd;
+    /* Set before accepting connections to share the port with other servers in this process, so the kernel spreads
+     the connections over their listeners (SO_REUSEPORT). Ignored where the platform doesn't have it */
+    bool reusePort;
     /* User field for whatever - if your request handler you can do connection->server->tag */
     void* tag; 
 
@@ -298,6 +335,10 @@ struct Response* responseAllocHTMLWithFormat(const char* format, ...) __printfli
 struct Response* responseAllocHTMLWithStatus(int code, const char* status, const char* html);
 struct Response* responseAllocJSON(const char* json);
 struct Response* responseAllocJSONWithStatus(int code, const char* status, const char* json);
+/* For bodies that never change, like error messages. The body is sent from where it is instead of being copied */
+struct Response* responseAllocConstant(int code, const char* status, const char* contentType, const char* body, size_t bodyLength);
+/* For headers that are the same for every response, like CORS headers. They are sent as they are instead of being copied */
+void responseSetStaticExtraHeaders(struct Response* response, const char* extraHeaders);
 struct Response* responseAllocJSONWithFormat(const char* format, ...) __printflike(1, 0);
 struct Response* responseAllocWithFormat(int code, const char* status, const char* contentType, const char* format, ...) __printflike(3, 0);
 /* If you leave the MIMETypeOrNULL NULL, the MIME type will be auto-detected */
@@ -335,6 +376,10 @@ void heapStringAppendFormat(struct HeapString* string, const char* format, ...)
 void heapStringAppendString(struct HeapString* string, const char* stringToAppend);
 void heapStringAppendFormatV(struct HeapString* string, const char* format, va_list ap);
 void heapStringAppendHeapString(struct HeapString* target, const struct HeapString* source);
+
+void* arenaAlloc(struct Arena* arena, size_t size);
+char* arenaStrdup(struct Arena* arena, const char* string);
+void arenaReset(struct Arena* arena);
 /* functions that help when serving files */
 const char* MIMETypeFromFile(const char* filename, const uint8_t* contents, size_t contentsLength);
 
@@ -350,10 +395,14 @@ void EWSUnitTestsRun(void);
 
 /* Internal implementation stuff */
 
-/* these counters exist solely for the purpose of the /status demo */
-static struct Counters {
-    bool lockInitialized;
-    pthread_mutex_t lock;
+#ifdef _MSC_VER
+#define EWS_THREAD_LOCAL __declspec(thread)
+#else
+#define EWS_THREAD_LOCAL __thread
+#endif
+
+/* these counters exist solely for the purpose of the /status demo. Every field is an int64_t, see countersRead */
+struct Counters {
     int64_t bytesReceived;
     int64_t bytesSent;
     int64_t totalConnections;
@@ -362,12 +411,94 @@ static struct Counters {
     int64_t heapStringReallocations;
     int64_t heapStringFrees;
     int64_t heapStringTotalBytesReallocated;
-} counters;
+    int64_t connectionsAllocated;
+    int64_t connectionsReused;
+};
+
+/* Each thread adds to one of COUNTER_STRIPES copies of the counters without taking a lock. The copies are cache line
+ aligned so threads on different stripes don't fight over cache lines, and they are only summed when read */
+#define COUNTER_STRIPES 16
+#define COUNTER_CACHE_LINE 64
+
+#ifdef _MSC_VER
+#define EWS_ALIGN_CACHE_LINE __declspec(align(64))
+#define ewsAtomicAdd(pointer, amount) InterlockedExchangeAdd64((volatile LONG64*) (pointer), (amount))
+#define ewsAtomicLoad(pointer) (*(volatile int64_t*) (pointer))
+#define ewsAtomicLoadAcquire(pointer) InterlockedCompareExchange64((volatile LONG64*) (pointer), 0, 0)
+#define ewsAtomicStoreRelease(pointer, value) InterlockedExchange64((volatile LONG64*) (pointer), (value))
+#define ewsAtomicCompareExchange(pointer, expected, desired) (InterlockedCompareExchange64((volatile LONG64*) (pointer), (desired), (expected)) == (expected))
+#else
+#define EWS_ALIGN_CACHE_LINE __attribute__((aligned(64)))
+#define ewsAtomicAdd(pointer, amount) __atomic_fetch_add((pointer), (amount), __ATOMIC_RELAXED)
+#define ewsAtomicLoad(pointer) __atomic_load_n((pointer), __ATOMIC_RELAXED)
+#define ewsAtomicLoadAcquire(pointer) __atomic_load_n((pointer), __ATOMIC_ACQUIRE)
+#define ewsAtomicStoreRelease(pointer, value) __atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+#define ewsAtomicCompareExchange(pointer, expected, desired) __sync_bool_compare_and_swap((pointer), (expected), (desired))
+#endif
+
+static EWS_ALIGN_CACHE_LINE union CounterStripe {
+    struct Counters counters;
+    char padding[(sizeof(struct Counters) + COUNTER_CACHE_LINE - 1) / COUNTER_CACHE_LINE * COUNTER_CACHE_LINE];
+} counterStripes[COUNTER_STRIPES];
+
+static int64_t nextCounterStripe;
+static EWS_THREAD_LOCAL int threadCounterStripe = -1;
+
+/* threads get stripes round robin the first time they count something */
+static int counterStripeForThisThread(void) {
+    if (threadCounterStripe < 0) {
+        threadCounterStripe = (int) (ewsAtomicAdd(&nextCounterStripe, 1) % COUNTER_STRIPES);
+    }
+    return threadCounterStripe;
+}
+
+#define counterAdd(field, amount) ewsAtomicAdd(&counterStripes[counterStripeForThisThread()].counters.field, (int64_t) (amount))
+
+/* sums the stripes. Counters that are updated meanwhile may be off by those updates, but never torn */
+static void countersRead(struct Counters* total) {
+    int64_t* totals = (int64_t*) total;
+    memset(total, 0, sizeof(*total));
+    for (int stripe = 0; stripe < COUNTER_STRIPES; stripe++) {
+        const int64_t* values = (const int64_t*) &counterStripes[stripe].counters;
+        for (size_t field = 0; field < sizeof(struct Counters) / sizeof(int64_t); field++) {
+            totals[field] += ewsAtomicLoad(&values[field]);
+        }
+    }
+}
+
+/* Finished connections are kept here instead of being freed, so accepting a connection doesn't cost a calloc of all
+ its buffers. At most CONNECTION_POOL_MAX are kept, which bounds the memory held by idle connections */
+#define CONNECTION_POOL_MAX 64
+static struct ConnectionPool {
+    bool lockInitialized;
+    pthread_mutex_t lock;
+    struct Connection* first;
+    int64_t count;
+} connectionPool;
+
+/* Buffers given back after a response wait here for the next request on any connection, at most CONNECTION_POOL_MAX */
+static struct ConnectionBuffersPool {
+    pthread_mutex_t lock;
+    struct ConnectionBuffers* first;
+    int64_t count;
+} connectionBuffersPool;
 
 #ifndef MIN
 #define MIN(a, b) ((a < b) ? a : b)
 #endif
 
+/* The arena of the connection handled by this thread, so the responseAlloc* functions can use it */
+static EWS_THREAD_LOCAL struct Arena* currentArena;
+
+/* the size of a response body allocated in the arena unless a size is given */
+#define RESPONSE_ARENA_BODY_SIZE 512
+
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    /* 16 bytes with the padding, so the allocation that follows is aligned */
+    uint64_t padding;
+};
+
 struct PathInformation {
     bool exists;
     bool isDirectory;
@@ -377,11 +508,14 @@ static void responseFree(struct Response* response);
 static void printIPv4Addresses(uint16_t portInHostOrder);
 static struct Connection* connectionAlloc(struct Server* server);
 static void connectionFree(struct Connection* connection);
-static void requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength);
+static void connectionBuffersAcquire(struct Connection* connection);
+static void connectionBuffersRelease(struct Connection* connection);
+static size_t requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength);
+static bool requestKeepsConnectionAlive(const struct Request* request);
 static int acceptConnectionsUntilStoppedInternal(struct Server* server, const struct sockaddr* address, socklen_t addressLength);
 static size_t heapStringNextAllocationSize(size_t required);
 static void poolStringStartNewString(struct PoolString* poolString, struct Request* request);
-static void poolStringAppendChar(struct Request* request, struct PoolString* string, char c);
+static void poolStringAppendChars(struct Request* request, struct PoolString* string, const char* chars, size_t count);
 static bool strEndsWith(const char* big, const char* endsWith);
 static void ignoreSIGPIPE(void);
 static void callWSAStartupIfNecessary(void);
@@ -389,7 +523,7 @@ static FILE* fopen_utf8_path(const char* utf8Path, const char* mode);
 static int pathInformationGet(const char* path, struct PathInformation* info);
 static int sendResponseBody(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
 static int sendResponseFile(struct Connection* connection, const struct Response* response, ssize_t* bytesSent);
-static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType, const char* extraHeaders, size_t contentLength);
+static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType, const char* extraHeaders, size_t contentLength, bool keepAlive);
 
 #ifdef WIN32 /* Windows implementations of functions available on Linux/Mac OS X */
     /* opendir/readdir/closedir API implementation with FindNextFile */
@@ -716,20 +850,26 @@ static void heapStringReallocIfNeeded(struct HeapString* string, size_t minimumC
     /* to avoid many reallocations every time we call AppendChar, round up to the next power of two */
     string->capacity = heapStringNextAllocationSize(minimumCapacity);
     assert(string->capacity > 0 && "We are about to allocate a string with 0 capacity. We should have checked this condition above");
-    bool previouslyAllocated = string->contents != NULL;
-    /* Sometimes string->contents is NULL. realloc handles that case so no need for an extra if (NULL) malloc else realloc */
-    string->contents = (char*) realloc(string->contents, string->capacity);
+    bool previouslyAllocated = string->contents != NULL && !string->contentsBorrowed;
+    if (string->contentsBorrowed) {
+        /* the arena can't grow an allocation, so move to the heap */
+        char* heapContents = (char*) malloc(string->capacity);
+        memcpy(heapContents, string->contents, string->length);
+        string->contents = heapContents;
+        string->contentsBorrowed = false;
+    } else {
+        /* Sometimes string->contents is NULL. realloc handles that case so no need for an extra if (NULL) malloc else realloc */
+        string->contents = (char*) realloc(string->contents, string->capacity);
+    }
 	/* zero out the newly allocated memory */
     memset(&string->contents[string->length], 0, string->capacity - string->length);
     if (OptionIncludeStatusPageAndCounters) {
-        pthread_mutex_lock(&counters.lock);
         if (previouslyAllocated) {
-            counters.heapStringReallocations++;
+            counterAdd(heapStringReallocations, 1);
         } else {
-            counters.heapStringAllocations++;
+            counterAdd(heapStringAllocations, 1);
         }
-        counters.heapStringTotalBytesReallocated += string->capacity;
-        pthread_mutex_unlock(&counters.lock);
+        counterAdd(heapStringTotalBytesReallocated, string->capacity);
     }
 }
 
@@ -835,9 +975,14 @@ void heapStringInit(struct HeapString* string) {
     string->capacity = 0;
     string->contents = NULL;
     string->length = 0;
+    string->contentsBorrowed = false;
 }
 
 void heapStringFreeContents(struct HeapString* string) {
+    if (string->contentsBorrowed) {
+        heapStringInit(string);
+        return;
+    }
     if (NULL != string->contents) {
         assert(string->capacity > 0 && "A heap string had a capacity > 0 with non-NULL contents which implies a malloc(0)");
         free(string->contents);
@@ -845,9 +990,7 @@ void heapStringFreeContents(struct HeapString* string) {
         string->capacity = 0;
         string->length = 0;
         if (OptionIncludeStatusPageAndCounters) {
-            pthread_mutex_lock(&counters.lock);
-            counters.heapStringFrees++;
-            pthread_mutex_unlock(&counters.lock);
+            counterAdd(heapStringFrees, 1);
         }
     } else {
         assert(string->capacity == 0 && "Why did a string with a NULL contents have a capacity > 0? This is not correct and may indicate corruption");
@@ -930,18 +1073,78 @@ static void poolStringStartNewString(struct PoolString* poolString, struct Reque
     poolString->length = 0;
 }
 
-static void poolStringAppendChar(struct Request* request, struct PoolString* string, char c) {
-    if (request->headersStringPoolOffset >= REQUEST_HEADERS_MAX_MEMORY - 1 - sizeof('\0')) { // we need to store one character (-1) and a null character at the end of the last string sizeof('\0')
+/* Appends count characters to the string with one bounds check and one memcpy */
+static void poolStringAppendChars(struct Request* request, struct PoolString* string, const char* chars, size_t count) {
+    size_t poolLimit = REQUEST_HEADERS_MAX_MEMORY - 1 - sizeof('\0');
+    size_t available = request->headersStringPoolOffset < poolLimit ? poolLimit - request->headersStringPoolOffset : 0;
+    if (count > available) {
         request->warnings.headersStringPoolExhausted = true;
-        return;
+        count = available;
+    }
+    memcpy(&string->contents[string->length], chars, count);
+    string->length += count;
+    request->headersStringPoolOffset += count;
+}
+
+/* Where the run of characters that don't need the state machine ends: at the first stop character, or at the end */
+static size_t requestRunLength(const char* start, size_t length, char stop, char otherStop) {
+    /* memchr is vectorized in every libc we care about, so two scans beat one loop checking both characters */
+    const char* end = (const char*) memchr(start, stop, length);
+    size_t runLength = NULL != end ? (size_t) (end - start) : length;
+    if (0 != otherStop) {
+        const char* otherEnd = (const char*) memchr(start, otherStop, runLength);
+        if (NULL != otherEnd) {
+            runLength = (size_t) (otherEnd - start);
+        }
     }
-    string->contents[string->length] = c;
-    string->length++;
-    request->headersStringPoolOffset++;
+    return runLength;
+}
+
+void* arenaAlloc(struct Arena* arena, size_t size) {
+    /* keep every allocation 16 byte aligned */
+    size_t alignment = (size_t) (-(uintptr_t) (arena->buffer + arena->used) & 15);
+    if (arena->used + alignment + size <= ARENA_SIZE) {
+        void* allocation = arena->buffer + arena->used + alignment;
+        arena->used += alignment + size;
+        return allocation;
+    }
+    struct ArenaBlock* block = (struct ArenaBlock*) malloc(sizeof(*block) + size);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block + 1;
+}
+
+char* arenaStrdup(struct Arena* arena, const char* string) {
+    size_t length = strlen(string);
+    char* copy = (char*) arenaAlloc(arena, length + 1);
+    memcpy(copy, string, length + 1);
+    return copy;
+}
+
+void arenaReset(struct Arena* arena) {
+    while (NULL != arena->blocks) {
+        struct ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    arena->used = 0;
 }
 
 // allocates a response with content = malloc(contentLength + 1) so you can write null-terminated strings to it
 struct Response* responseAlloc(int code, const char* status, const char* contentType, size_t bodyCapacity) {
+    if (NULL != currentArena) {
+        struct Response* response = (struct Response*) arenaAlloc(currentArena, sizeof(*response));
+        memset(response, 0, sizeof(*response));
+        response->code = code;
+        response->allocatedInArena = true;
+        response->body.capacity = bodyCapacity > 0 ? bodyCapacity : RESPONSE_ARENA_BODY_SIZE;
+        response->body.contents = (char*) arenaAlloc(currentArena, response->body.capacity);
+        response->body.contents[0] = '\0';
+        response->body.contentsBorrowed = true;
+        response->contentType = NULL != contentType ? arenaStrdup(currentArena, contentType) : NULL;
+        response->status = NULL != status ? arenaStrdup(currentArena, status) : NULL;
+        return response;
+    }
     struct Response* response = (struct Response*) calloc(1, sizeof(*response));
     response->code = code;
     heapStringInit(&response->body);
@@ -950,9 +1153,7 @@ struct Response* responseAlloc(int code, const char* status, const char* content
     if (response->body.capacity > 0) {
         response->body.contents = (char*) calloc(1, response->body.capacity);
         if (OptionIncludeStatusPageAndCounters) {
-            pthread_mutex_lock(&counters.lock);
-            counters.heapStringAllocations++;
-            pthread_mutex_unlock(&counters.lock);
+            counterAdd(heapStringAllocations, 1);
         }
     }
     response->contentType = strdupIfNotNull(contentType);
@@ -1269,20 +1470,43 @@ struct Response* responseAllocWithFile(const char* filename, const char* MIMETyp
     return response;
 }
 
-static void responseFree(struct Response* response) {
-    if (NULL != response->status) {
-        free(response->status);
+struct Response* responseAllocConstant(int code, const char* status, const char* contentType, const char* body, size_t bodyLength) {
+    struct Response* response = responseAlloc(code, status, contentType, 1);
+    heapStringFreeContents(&response->body);
+    /* borrowed contents are never written to or freed */
+    response->body.contents = (char*) body;
+    response->body.length = bodyLength;
+    response->body.capacity = bodyLength + 1;
+    response->body.contentsBorrowed = true;
+    return response;
+}
+
+void responseSetStaticExtraHeaders(struct Response* response, const char* extraHeaders) {
+    if (NULL != response->extraHeaders && !response->extraHeadersStatic) {
+        free(response->extraHeaders);
     }
+    response->extraHeaders = (char*) extraHeaders;
+    response->extraHeadersStatic = true;
+}
+
+static void responseFree(struct Response* response) {
     if (NULL != response->filenameToSend) {
         free(response->filenameToSend);
     }
-    if (NULL != response->contentType) {
-        free(response->contentType);
-    }
-    if (NULL != response->extraHeaders) {
+    if (NULL != response->extraHeaders && !response->extraHeadersStatic) {
         free(response->extraHeaders);
     }
     heapStringFreeContents(&response->body);
+    if (response->allocatedInArena) {
+        /* the rest goes away with the arena */
+        return;
+    }
+    if (NULL != response->status) {
+        free(response->status);
+    }
+    if (NULL != response->contentType) {
+        free(response->contentType);
+    }
     free(response);
 }
 
@@ -1299,7 +1523,8 @@ static RequestParseState stateHeaderNameIfSpaceLeft(struct Request* request) {
 }
 
 /* parses a typical HTTP request looking for the first line: GET /path HTTP/1.0\r\n */
-static void requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength) {
+/* Returns how much of the fragment was used, which is all of it unless the request was done before its end */
+static size_t requestParse(struct Request* request, const char* requestFragment, size_t requestFragmentLength) {
     for (size_t i = 0; i < requestFragmentLength; i++) {
         char c = requestFragment[i];
         switch (request->state) {
@@ -1319,11 +1544,16 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                     bool success = URLDecode(request->path, request->pathDecoded, sizeof(request->pathDecoded), &request->pathDecodedLength, URLDecodeTypeWholeURL);
                     assert(success && "Somehow unable to decode the path--this should always work with ->pathDecoded has the same capacity as ->path");
                     request->state = RequestParseStateVersion;
-                } else if (request->pathLength < sizeof(request->path) - 1) {
-                    request->path[request->pathLength] = c;
-                    request->pathLength++;
                 } else {
-                    request->warnings.pathTruncated = true;
+                    /* copy the path up to the space in one go */
+                    size_t runLength = requestRunLength(&requestFragment[i], requestFragmentLength - i, ' ', 0);
+                    size_t copyLength = MIN(runLength, sizeof(request->path) - 1 - request->pathLength);
+                    memcpy(&request->path[request->pathLength], &requestFragment[i], copyLength);
+                    request->pathLength += copyLength;
+                    if (copyLength < runLength) {
+                        request->warnings.pathTruncated = true;
+                    }
+                    i += runLength - 1;
                 }
                 break;
             case RequestParseStateVersion:
@@ -1347,8 +1577,10 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                     if (NULL == request->headers[request->headersCount].name.contents) {
                         poolStringStartNewString(&request->headers[request->headersCount].name, request);
                     }
-                    /* store the header name in the string pool */
-                    poolStringAppendChar(request, &request->headers[request->headersCount].name, c);
+                    /* store the header name up to the colon or the end of the line in the string pool */
+                    size_t runLength = requestRunLength(&requestFragment[i], requestFragmentLength - i, '\r', ':');
+                    poolStringAppendChars(request, &request->headers[request->headersCount].name, &requestFragment[i], runLength);
+                    i += runLength - 1;
                 }
                 break;
             case RequestParseStateHeaderValue:
@@ -1369,8 +1601,10 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                     if (NULL == request->headers[request->headersCount].value.contents) {
                         poolStringStartNewString(&request->headers[request->headersCount].value, request);
                     }
-                    /* store the header name in the string pool */
-                    poolStringAppendChar(request, &request->headers[request->headersCount].value, c);
+                    /* store the header value up to the end of the line in the string pool */
+                    size_t runLength = requestRunLength(&requestFragment[i], requestFragmentLength - i, '\r', 0);
+                    poolStringAppendChars(request, &request->headers[request->headersCount].value, &requestFragment[i], runLength);
+                    i += runLength - 1;
                 }
                 break;
             case RequestParseStateCR:
@@ -1408,7 +1642,11 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                                 ews_printf_debug("Warning: Incoming request has negative content length: %ld\n", contentLength);
                                 contentLength = 0;
                             }
-                            if (contentLength > 0) {
+                            if (contentLength > 0 && NULL != currentArena) {
+                                request->body.contents = (char*) arenaAlloc(currentArena, contentLength + 1);
+                                memset(request->body.contents, 0, contentLength + 1);
+                                request->body.contentsBorrowed = true;
+                            } else if (contentLength > 0) {
                                 request->body.contents = (char*)calloc(1, contentLength + 1);
                             }
                             request->body.capacity = contentLength;
@@ -1428,23 +1666,43 @@ static void requestParse(struct Request* request, const char* requestFragment, s
                     request->state = RequestParseStateCR;
                 }
                 break;
-            case RequestParseStateBody:
-                /* Copy the request body into request->body - the .length is from Content-Length so don't trust that (found with afl-fuzz!) */
-                if (request->body.length < request->body.capacity) {
-                    request->body.contents[request->body.length] = c;
-                    request->body.length++;
+            case RequestParseStateBody: {
+                /* Copy the request body into request->body - the .length is from Content-Length so don't trust that (found with afl-fuzz!)
+                 All of the body in this fragment is copied at once */
+                size_t bodyBytes = MIN(request->body.capacity - request->body.length, requestFragmentLength - i);
+                if (bodyBytes > 0) {
+                    memcpy(&request->body.contents[request->body.length], &requestFragment[i], bodyBytes);
+                    request->body.length += bodyBytes;
+                    i += bodyBytes - 1;
                 }
                 if (request->body.length == request->body.capacity) {
                     request->state = RequestParseStateDone;
                 }
                 break;
+            }
             case RequestParseStateDone:
                 if (NULL != request->body.contents) {
                     request->warnings.bodyTruncated = true;
                 }
-                break;
+                /* nothing after this changes the request */
+                return i;
+        }
+    }
+    return requestFragmentLength;
+}
+
+/* HTTP/1.1 connections stay open unless the client sends Connection: close, HTTP/1.0 ones only with Connection: keep-alive */
+static bool requestKeepsConnectionAlive(const struct Request* request) {
+    const struct Header* connectionHeader = headerInRequest("Connection", request);
+    if (NULL != connectionHeader && NULL != connectionHeader->value.contents) {
+        if (0 == strcasecmp(connectionHeader->value.contents, "close")) {
+            return false;
+        }
+        if (0 == strcasecmp(connectionHeader->value.contents, "keep-alive")) {
+            return true;
         }
     }
+    return 0 == strcmp(request->version, "HTTP/1.1");
 }
 
 static void requestPrintWarnings(const struct Request* request, const char* remoteHost, const char* remotePort) {
@@ -1468,15 +1726,97 @@ static void requestPrintWarnings(const struct Request* request, const char* remo
     }
 }
 
+/* Puts a request back in the state calloc leaves it in. The header string pool is only cleared as far as it was used */
+static void requestReset(struct Request* request) {
+    heapStringFreeContents(&request->body);
+    size_t usedPool = MIN(request->headersStringPoolOffset + 2, sizeof(request->headersStringPool));
+    memset(request, 0, offsetof(struct Request, headersStringPool));
+    memset(request->headersStringPool, 0, usedPool);
+    request->headersStringPoolOffset = 0;
+    memset(&request->warnings, 0, sizeof(request->warnings));
+    request->state = RequestParseStateMethod;
+}
+
 static struct Connection* connectionAlloc(struct Server* server) {
-    struct Connection* connection = (struct Connection*) calloc(1, sizeof(*connection)); // calloc 0's everything which requestParse depends on
+    pthread_mutex_lock(&connectionPool.lock);
+    struct Connection* connection = connectionPool.first;
+    if (NULL != connection) {
+        connectionPool.first = connection->nextPooled;
+        connectionPool.count--;
+    }
+    pthread_mutex_unlock(&connectionPool.lock);
+    if (NULL != connection) {
+        /* the buffers are overwritten before they are read, only the bookkeeping needs to be cleared */
+        connection->nextPooled = NULL;
+        memset(&connection->status, 0, sizeof(connection->status));
+        if (OptionIncludeStatusPageAndCounters) {
+            counterAdd(connectionsReused, 1);
+        }
+    } else {
+        connection = (struct Connection*) calloc(1, sizeof(*connection)); // calloc 0's everything which requestParse depends on
+        if (OptionIncludeStatusPageAndCounters) {
+            counterAdd(connectionsAllocated, 1);
+        }
+    }
     connection->server = server;
     return connection;
 }
 
+static void connectionBuffersAcquire(struct Connection* connection) {
+    pthread_mutex_lock(&connectionBuffersPool.lock);
+    struct ConnectionBuffers* buffers = connectionBuffersPool.first;
+    if (NULL != buffers) {
+        connectionBuffersPool.first = buffers->nextPooled;
+        connectionBuffersPool.count--;
+    }
+    pthread_mutex_unlock(&connectionBuffersPool.lock);
+    if (NULL == buffers) {
+        /* only the arena bookkeeping has to start out zeroed, the buffers are overwritten before they are read */
+        buffers = (struct ConnectionBuffers*) malloc(sizeof(*buffers));
+        buffers->arena.used = 0;
+        buffers->arena.blocks = NULL;
+    }
+    buffers->nextPooled = NULL;
+    connection->buffers = buffers;
+    currentArena = &buffers->arena;
+}
+
+/* The request must not point into the arena anymore */
+static void connectionBuffersRelease(struct Connection* connection) {
+    struct ConnectionBuffers* buffers = connection->buffers;
+    if (NULL == buffers) {
+        return;
+    }
+    connection->buffers = NULL;
+    currentArena = NULL;
+    arenaReset(&buffers->arena);
+    pthread_mutex_lock(&connectionBuffersPool.lock);
+    if (connectionBuffersPool.count < CONNECTION_POOL_MAX) {
+        buffers->nextPooled = connectionBuffersPool.first;
+        connectionBuffersPool.first = buffers;
+        connectionBuffersPool.count++;
+        buffers = NULL;
+    }
+    pthread_mutex_unlock(&connectionBuffersPool.lock);
+    if (NULL != buffers) {
+        free(buffers);
+    }
+}
+
 static void connectionFree(struct Connection* connection) {
-    heapStringFreeContents(&connection->request.body);
-    free(connection);
+    requestReset(&connection->request);
+    connectionBuffersRelease(connection);
+    pthread_mutex_lock(&connectionPool.lock);
+    if (connectionPool.count < CONNECTION_POOL_MAX) {
+        connection->nextPooled = connectionPool.first;
+        connectionPool.first = connection;
+        connectionPool.count++;
+        connection = NULL;
+    }
+    pthread_mutex_unlock(&connectionPool.lock);
+    if (NULL != connection) {
+        free(connection);
+    }
 }
 
 static void SIGPIPEHandler(int signal) {
@@ -1499,10 +1839,11 @@ void serverInit(struct Server* server) {
     server->shouldRun = true;
     server->initialized = true;
     ignoreSIGPIPE();
-    /* kind of hacky and not thread-safe but I'm ok with that for just these counters */
-    if (!counters.lockInitialized) {
-        pthread_mutex_init(&counters.lock, NULL);
-        counters.lockInitialized = true;
+    /* kind of hacky and not thread-safe but I'm ok with that for just the connection pool */
+    if (!connectionPool.lockInitialized) {
+        pthread_mutex_init(&connectionPool.lock, NULL);
+        pthread_mutex_init(&connectionBuffersPool.lock, NULL);
+        connectionPool.lockInitialized = true;
     }
 }
 
@@ -1586,6 +1927,14 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
     if (0 != result) {
         ews_printf("Failed to setsockopt SO_REUSEADDR = true with %s = %d. Continuing because we might still succeed...\n", strerror(errno), errno);
     }
+#ifdef SO_REUSEPORT
+    if (server->reusePort) {
+        result = setsockopt(server->listenerfd, SOL_SOCKET, SO_REUSEPORT, (char*)&reuse, sizeof(reuse));
+        if (0 != result) {
+            ews_printf("Failed to setsockopt SO_REUSEPORT = true with %s = %d. Binding will fail if another server has the port...\n", strerror(errno), errno);
+        }
+    }
+#endif
 
     if (address->sa_family == AF_INET6) {
         int ipv6only = 0;
@@ -1634,6 +1983,10 @@ static int acceptConnectionsUntilStoppedInternal(struct Server* server, const st
             ews_printf("exiting because accept failed (probably interrupted) %s = %d\n", strerror(errno), errno);
             break;
         }
+        /* the header and body go out in separate sends, so on a kept alive connection Nagle would hold the body
+        back until the client's delayed ACK of the header */
+        int noDelay = 1;
+        setsockopt(nextConnection->socketfd, IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
         pthread_mutex_lock(&server->connectionFinishedLock);
         server->activeConnectionCount++;
         pthread_mutex_unlock(&server->connectionFinishedLock);
@@ -1684,9 +2037,9 @@ static int sendResponse(struct Connection* connection, const struct Response* re
 
 static int sendResponseBody(struct Connection* connection, const struct Response* response, ssize_t* bytesSent) {
     /* First send the response HTTP headers */
-    int headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, response->contentType, response->extraHeaders, response->body.length);
+    int headerLength = snprintfResponseHeader(connection->buffers->responseHeader, RESPONSE_HEADER_SIZE, response->code, response->status, response->contentType, response->extraHeaders, response->body.length, connection->keepAlive);
     ssize_t sendResult;
-    sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
+    sendResult = send(connection->socketfd, connection->buffers->responseHeader, headerLength, 0);
     if (sendResult != headerLength) {
         ews_printf("Failed to respond to %s:%s because we could not send the HTTP response *header*. send returned %ld with %s = %d\n",
                connection->remoteHost,
@@ -1697,7 +2050,7 @@ static int sendResponseBody(struct Connection* connection, const struct Response
         return -1;
     }
     if (OptionPrintResponse) {
-        fwrite(connection->responseHeader, 1, headerLength, stdout);
+        fwrite(connection->buffers->responseHeader, 1, headerLength, stdout);
     }
     *bytesSent = *bytesSent + sendResult;
     /* Second, if a response body exists, send that */
@@ -1743,14 +2096,14 @@ static int sendResponseFile(struct Connection* connection, const struct Response
     if (NULL != response->contentType) {
         contentType = response->contentType;
     } else {
-        assert(sizeof(connection->sendRecvBuffer) >= MIMEReadSize);
-        actualMIMEReadSize = fread(connection->sendRecvBuffer, 1, MIMEReadSize, fp);
+        assert(SEND_RECV_BUFFER_SIZE >= MIMEReadSize);
+        actualMIMEReadSize = fread(connection->buffers->sendRecvBuffer, 1, MIMEReadSize, fp);
         if (0 == actualMIMEReadSize) {
             ews_printf("Unable to satisfy request for '%s' because we could read the first bunch of bytes to determine MIME type '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
             errorResponse = responseAlloc500InternalErrorHTML("fread for MIME type detection failed");
             goto exit;
         }
-        contentType = MIMETypeFromFile(response->filenameToSend, (const uint8_t*)connection->sendRecvBuffer, actualMIMEReadSize);
+        contentType = MIMETypeFromFile(response->filenameToSend, (const uint8_t*)connection->buffers->sendRecvBuffer, actualMIMEReadSize);
         ews_printf_debug("Detected MIME type '%s' for file '%s'\n", contentType, response->filenameToSend);
     }
     /* get the file length, laboriously checking for errors */
@@ -1774,20 +2127,20 @@ static int sendResponseFile(struct Connection* connection, const struct Response
     }
     
     /* now we have the file length + MIME TYpe and we can send the header */
-    headerLength = snprintfResponseHeader(connection->responseHeader, sizeof(connection->responseHeader), response->code, response->status, contentType, response->extraHeaders, fileLength);
-    sendResult = send(connection->socketfd, connection->responseHeader, headerLength, 0);
+    headerLength = snprintfResponseHeader(connection->buffers->responseHeader, RESPONSE_HEADER_SIZE, response->code, response->status, contentType, response->extraHeaders, fileLength, connection->keepAlive);
+    sendResult = send(connection->socketfd, connection->buffers->responseHeader, headerLength, 0);
     if (sendResult != headerLength) {
         ews_printf("Unable to satisfy request for '%s' because we could not send the HTTP header '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
         result = 1;
         goto exit;
     }
     if (OptionPrintResponse) {
-        fwrite(connection->responseHeader, 1, headerLength, stdout);
+        fwrite(connection->buffers->responseHeader, 1, headerLength, stdout);
     }
     *bytesSent = sendResult;
     /* read the whole file, just buffering into the connection buffer, and sending it out to the socket */
     while (!feof(fp)) {
-        size_t bytesRead = fread(connection->sendRecvBuffer, 1, sizeof(connection->sendRecvBuffer), fp);
+        size_t bytesRead = fread(connection->buffers->sendRecvBuffer, 1, SEND_RECV_BUFFER_SIZE, fp);
         if (0 == bytesRead) { /* peacefull end of file */
             break;
         }
@@ -1797,14 +2150,14 @@ static int sendResponseFile(struct Connection* connection, const struct Response
             goto exit;
         }
         /* send the data out the socket to the network */
-        sendResult = send(connection->socketfd, connection->sendRecvBuffer, bytesRead, 0);
+        sendResult = send(connection->socketfd, connection->buffers->sendRecvBuffer, bytesRead, 0);
         if (sendResult != (ssize_t) bytesRead) {
             ews_printf("Unable to satisfy request for '%s' because there was an error sending bytes. '%s' %s = %d\n", connection->request.path, response->filenameToSend, strerror(errno), errno);
             result = 1;
             goto exit;
         }
         if (OptionPrintResponse) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+            fwrite(connection->buffers->sendRecvBuffer, 1, bytesRead, stdout);
         }
 
         *bytesSent = *bytesSent + sendResult;
@@ -1847,69 +2200,97 @@ static THREAD_RETURN_TYPE STDCALL_ON_WIN32 connectionHandlerThread(void* connect
                 connection->remotePort, sizeof(connection->remotePort), NI_NUMERICHOST | NI_NUMERICSERV);
     ews_printf_debug("New connection from %s:%s...\n", connection->remoteHost, connection->remotePort);
     if (OptionIncludeStatusPageAndCounters) {
-        pthread_mutex_lock(&counters.lock);
-        counters.activeConnections++;
-        counters.totalConnections++;
-        pthread_mutex_unlock(&counters.lock);
-    }
-    /* first read the request + request body */
-    bool madeRequestPrintf = false;
-    bool foundRequest = false;
-    ssize_t bytesRead;
-    while ((bytesRead = recv(connection->socketfd, connection->sendRecvBuffer, SEND_RECV_BUFFER_SIZE, 0)) > 0) {
-        if (OptionPrintWholeRequest) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+        counterAdd(activeConnections, 1);
+        counterAdd(totalConnections, 1);
+    }
+    /* Requests are served one after another until the client or OptionKeepAlive says otherwise */
+    int requestsServed = 0;
+    while (true) {
+        if (requestsServed > 0) {
+            /* wait for the next request without holding buffers, a byte is only peeked at so that it is still read below */
+            char nextByte;
+            if (recv(connection->socketfd, &nextByte, 1, MSG_PEEK) <= 0) {
+                /* the client closed a kept alive connection or it timed out between requests, which is not worth a warning */
+                break;
+            }
         }
-        connection->status.bytesReceived += bytesRead;
-        requestParse(&connection->request, connection->sendRecvBuffer, bytesRead);
-        if (connection->request.state >= RequestParseStateVersion && !madeRequestPrintf) {
-            ews_printf_debug("Request from %s:%s: %s to %s HTTP version %s\n",
-                   connection->remoteHost,
-                   connection->remotePort,
-                   connection->request.method,
-                   connection->request.path,
-                   connection->request.version);
-            madeRequestPrintf = true;
+        connectionBuffersAcquire(connection);
+        /* first read the request + request body */
+        bool madeRequestPrintf = false;
+        bool foundRequest = false;
+        size_t bytesLeftOver = 0;
+        ssize_t bytesRead;
+        while ((bytesRead = recv(connection->socketfd, connection->buffers->sendRecvBuffer, SEND_RECV_BUFFER_SIZE, 0)) > 0) {
+            if (OptionPrintWholeRequest) {
+                fwrite(connection->buffers->sendRecvBuffer, 1, bytesRead, stdout);
+            }
+            connection->status.bytesReceived += bytesRead;
+            size_t bytesParsed = requestParse(&connection->request, connection->buffers->sendRecvBuffer, bytesRead);
+            if (connection->request.state >= RequestParseStateVersion && !madeRequestPrintf) {
+                ews_printf_debug("Request from %s:%s: %s to %s HTTP version %s\n",
+                       connection->remoteHost,
+                       connection->remotePort,
+                       connection->request.method,
+                       connection->request.path,
+                       connection->request.version);
+                madeRequestPrintf = true;
+            }
+            if (connection->request.state == RequestParseStateDone) {
+                foundRequest = true;
+                bytesLeftOver = bytesRead - bytesParsed;
+                break;
+            }
+#ifdef EWS_FUZZ_TESTING /* This enables us to fuzz test different content lengths */
+            if (connection->request.state == RequestParseStateBody) {
+                foundRequest = true;
+            }
+#endif
         }
-        if (connection->request.state == RequestParseStateDone) {
-            foundRequest = true;
+        requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
+        if (!foundRequest) {
+            ews_printf("No request found from %s:%s? Closing connection. Here's the last bytes we received in the request (length %" PRIi64 "). The total bytes received on this connection: %" PRIi64 " :\n", connection->remoteHost, connection->remotePort, (int64_t) bytesRead, connection->status.bytesReceived);
+            if (bytesRead > 0) {
+                fwrite(connection->buffers->sendRecvBuffer, 1, bytesRead, stdout);
+            }
             break;
         }
-#ifdef EWS_FUZZ_TESTING /* This enables us to fuzz test different content lengths */
-        if (connection->request.state == RequestParseStateBody) {
-            foundRequest = true;
-        }
-#endif
-    }
-    requestPrintWarnings(&connection->request, connection->remoteHost, connection->remotePort);
-    ssize_t bytesSent = 0;
-    if (foundRequest) {
+        /* Pipelined requests are not supported, a client that sends the next request before the response gets the connection closed after this one */
+        connection->keepAlive = OptionKeepAlive && 0 == bytesLeftOver && requestKeepsConnectionAlive(&connection->request);
         struct Response* response = createResponseForRequestAutoreleased(&connection->request, connection);
-        if (NULL != response) {
-            int result = sendResponse(connection, response, &bytesSent);
-            if (0 == result) {
-                ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, response->code, response->status, (int64_t)bytesSent);
-            } else {
-                /* sendResponse already printed something out, don't add another ews_printf */
-            }
-            responseFree(response);
-            connection->status.bytesSent = bytesSent;
-        } else {
+        if (NULL == response) {
             ews_printf("%s:%s: You have returned a NULL response - I'm assuming you took over the request handling yourself.\n", connection->remoteHost, connection->remotePort);
+            break;
         }
-    } else {
-        ews_printf("No request found from %s:%s? Closing connection. Here's the last bytes we received in the request (length %" PRIi64 "). The total bytes received on this connection: %" PRIi64 " :\n", connection->remoteHost, connection->remotePort, (int64_t) bytesRead, connection->status.bytesReceived);
-        if (bytesRead > 0) {
-            fwrite(connection->sendRecvBuffer, 1, bytesRead, stdout);
+        ssize_t bytesSent = 0;
+        int result = sendResponse(connection, response, &bytesSent);
+        if (0 == result) {
+            ews_printf_debug("%s:%s: Responded with HTTP %d %s length %" PRId64 "\n", connection->remoteHost, connection->remotePort, response->code, response->status, (int64_t)bytesSent);
+        } else {
+            /* sendResponse already printed something out, don't add another ews_printf */
+        }
+        responseFree(response);
+        connection->status.bytesSent += bytesSent;
+        if (0 != result || !connection->keepAlive) {
+            break;
+        }
+        if (0 == requestsServed) {
+            /* an idle kept alive connection should not hold on to its thread forever */
+#ifdef WIN32
+            DWORD timeout = KEEP_ALIVE_TIMEOUT_SECONDS * 1000;
+#else
+            struct timeval timeout = {KEEP_ALIVE_TIMEOUT_SECONDS, 0};
+#endif
+            setsockopt(connection->socketfd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
         }
+        requestsServed++;
+        requestReset(&connection->request);
+        connectionBuffersRelease(connection);
     }
     /* Alright - we're done */
     close(connection->socketfd);
-    pthread_mutex_lock(&counters.lock);
-    counters.bytesSent += (ssize_t) connection->status.bytesSent;
-    counters.bytesReceived += (ssize_t) connection->status.bytesReceived;
-    counters.activeConnections--;
-    pthread_mutex_unlock(&counters.lock);
+    counterAdd(bytesSent, connection->status.bytesSent);
+    counterAdd(bytesReceived, connection->status.bytesReceived);
+    counterAdd(activeConnections, -1);
     ews_printf_debug("Connection from %s:%s closed\n", connection->remoteHost, connection->remotePort);
     pthread_mutex_lock(&connection->server->connectionFinishedLock);
     connection->server->activeConnectionCount--;
@@ -1995,7 +2376,7 @@ static bool strEndsWith(const char* big, const char* endsWith) {
     return true;
 }
 
-static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType,  const char* extraHeaders, size_t contentLength) {
+static int snprintfResponseHeader(char* destination, size_t destinationCapacity, int code, const char* status, const char* contentType,  const char* extraHeaders, size_t contentLength, bool keepAlive) {
     if (NULL == extraHeaders) {
         extraHeaders = "";
     }
@@ -2004,6 +2385,7 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
         "HTTP/1.1 %d %s\r\n"
         "Content-Type: %s\r\n"
         "Content-Length: %" PRIu64 "\r\n"
+        "Connection: %s\r\n"
         "Server: Embeddable Web Server/" EMBEDDABLE_WEB_SERVER_VERSION_STRING "\r\n"
         "%s"
         "\r\n",
@@ -2011,13 +2393,13 @@ static int snprintfResponseHeader(char* destination, size_t destinationCapacity,
         status,
         contentType,
         (uint64_t)contentLength,
+        keepAlive ? "keep-alive" : "close",
         extraHeaders);
 }
 
 /* Quick unit tests */
 
 static void testHeapString() {
-    pthread_mutex_init(&counters.lock, NULL);
     struct HeapString easy;
     heapStringInit(&easy);
     heapStringSetToCString(&easy, "Part1");
@@ -2164,7 +2546,7 @@ void EWSUnitTestsRun() {
     testPathMatching();
     testURLDecode();
     /* reset counters from tests */
-    memset(&counters, 0, sizeof(counters));
+    memset(counterStripes, 0, sizeof(counterStripes));
 }
 
 /* Platform specific stubs/handlers */
@@ -8,81 +8,233 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <ctype.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #else // Linux, macOS, and other Unix-like systems
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #endif
 
 #include "jsmn_stream.c"
 
-static uint64_t sequence_number = 1;
+// Extra whitespace reserved in each inserted container, relative to the document size, so updates can grow in place
+static double padding_factor = 0;
 
 #define ID_LENGTH 24
 
-// This does not need to be used for strings read by jsmn, they are already escaped
-char *escape_json_string(const char *input)
+// Kept up to date by insert and delete so that counting never needs to read the file
+typedef struct
 {
-  int length = 1; // For the null terminator
-  for (const char *p = input; *p; p++)
+  uint64_t live_documents;
+  uint64_t dead_documents;
+  uint64_t live_bytes; // Bytes used by the containers of live documents
+  uint64_t dead_bytes; // Bytes used by tombstoned containers, reclaimable
+} ddb_document_counts;
+
+#define HISTOGRAM_BUCKETS 24
+
+// Bucket i counts values up to unit << i and the last bucket everything larger, enough for /metrics at the cost of a few shifts.
+// Every field is a uint64_t updated with relaxed atomic adds, so histograms can be recorded without a lock and summed field by field
+typedef struct
+{
+  uint64_t buckets[HISTOGRAM_BUCKETS + 1];
+  uint64_t count;
+  uint64_t sum;
+} ddb_histogram;
+
+static void histogram_record(ddb_histogram *histogram, uint64_t value, uint64_t unit)
+{
+  int bucket = 0;
+  while (bucket < HISTOGRAM_BUCKETS && value > unit << bucket)
   {
-    length++;
-    if (*p == '\"' || *p == '\\')
-    {
-      length++;
-    }
+    bucket++;
   }
+  ewsAtomicAdd(&histogram->buckets[bucket], 1);
+  ewsAtomicAdd(&histogram->count, 1);
+  ewsAtomicAdd(&histogram->sum, value);
+}
+
+// What reading the files costs the queries of all collections, reported by /metrics. Every field is a uint64_t updated
+// with relaxed atomic adds, like ddb_histogram, since queries on different collections don't share a lock
+typedef struct
+{
+  uint64_t bytes_scanned;
+  ddb_histogram documents_examined; // Per query that read the file
+} ddb_scan_stats;
 
-  char *output = malloc(length * sizeof(char));
-  if (!output)
+static ddb_scan_stats scan_stats;
+
+static void scan_finished(uint64_t bytes, uint64_t documents)
+{
+  ewsAtomicAdd(&scan_stats.bytes_scanned, bytes);
+  histogram_record(&scan_stats.documents_examined, documents, 1);
+}
+
+static void scan_stats_read(ddb_scan_stats *total)
+{
+  uint64_t *totals = (uint64_t *)total;
+  const uint64_t *values = (const uint64_t *)&scan_stats;
+  for (size_t field = 0; field < sizeof(ddb_scan_stats) / sizeof(uint64_t); field++)
   {
-    return NULL;
+    totals[field] = ewsAtomicLoad(&values[field]);
   }
+}
 
-  char *q = output;
-  for (const char *p = input; *p; p++)
+typedef enum
+{
+  LOG_ERROR,
+  LOG_WARNING,
+  LOG_INFO,
+  LOG_DEBUG
+} ddb_log_level;
+
+static const char *log_level_names[] = {"error", "warning", "info", "debug"};
+static ddb_log_level log_level = LOG_INFO;
+
+// Log records are formatted into fixed size slots of a ring buffer and written to stdout by log_thread, so threads
+// handling requests never wait for the terminal. The ring is a bounded queue where each slot's sequence number says
+// whether it is free to write (position) or ready to read (position + 1). When it's full, records are dropped and counted
+#define LOG_RECORD_SIZE 256
+#define LOG_RING_SLOTS 1024
+
+typedef struct
+{
+  int64_t sequence;
+  ddb_log_level level;
+  char text[LOG_RECORD_SIZE];
+} ddb_log_slot;
+
+static ddb_log_slot log_ring[LOG_RING_SLOTS];
+static int64_t log_write_position;
+static int64_t log_dropped;
+
+void log_message(ddb_log_level level, const char *format, ...) __printflike(2, 3);
+
+void log_message(ddb_log_level level, const char *format, ...)
+{
+  if (level > log_level)
   {
-    if (*p == '\"' || *p == '\\')
+    return;
+  }
+  int64_t position = ewsAtomicLoad(&log_write_position);
+  ddb_log_slot *slot;
+  for (;;)
+  {
+    slot = &log_ring[position % LOG_RING_SLOTS];
+    int64_t ahead = ewsAtomicLoadAcquire(&slot->sequence) - position;
+    if (ahead < 0)
+    {
+      ewsAtomicAdd(&log_dropped, 1);
+      return;
+    }
+    if (ahead == 0 && ewsAtomicCompareExchange(&log_write_position, position, position + 1))
     {
-      *q++ = '\\';
+      break;
     }
-    *q++ = *p;
+    position = ewsAtomicLoad(&log_write_position);
   }
-  *q = '\0'; // Null-terminate the output string
+  slot->level = level;
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(slot->text, sizeof(slot->text), format, ap);
+  va_end(ap);
+  ewsAtomicStoreRelease(&slot->sequence, position + 1);
+}
 
-  return output;
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 log_thread(void *unused)
+{
+  int64_t position = 0;
+  int64_t reported_dropped = 0;
+  for (;;)
+  {
+    ddb_log_slot *slot = &log_ring[position % LOG_RING_SLOTS];
+    if (ewsAtomicLoadAcquire(&slot->sequence) == position + 1)
+    {
+      printf("[%s] %s\n", log_level_names[slot->level], slot->text);
+      ewsAtomicStoreRelease(&slot->sequence, position + LOG_RING_SLOTS);
+      position++;
+      continue;
+    }
+    int64_t dropped = ewsAtomicLoad(&log_dropped);
+    if (dropped != reported_dropped)
+    {
+      printf("[warning] %" PRId64 " log records dropped, the log ring was full\n", dropped - reported_dropped);
+      reported_dropped = dropped;
+    }
+    fflush(stdout);
+#ifdef _WIN32
+    Sleep(5);
+#else
+    struct timespec pause = {0, 5 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+#endif
+  }
+  return (THREAD_RETURN_TYPE)0;
 }
 
-// TODO? Use heapstring from EmbeddableWebServer here instead of fixed buffer?
-int stringify_inner(const char *json, jsmntok_t *tokens, int num_tokens, int pos, char *dest, int *destpos, char *extra_key, char *extra_value);
+bool parse_log_level(const char *name, ddb_log_level *level)
+{
+  for (int i = LOG_ERROR; i <= LOG_DEBUG; i++)
+  {
+    if (0 == strcmp(name, log_level_names[i]))
+    {
+      *level = (ddb_log_level)i;
+      return true;
+    }
+  }
+  return false;
+}
 
-void stringify_primitive(const char *json, jsmntok_t *t, char *dest, int *destpos)
+void log_start()
 {
-  strncpy(dest + *destpos, json + t->start, t->end - t->start);
-  *destpos += t->end - t->start;
+  for (int64_t i = 0; i < LOG_RING_SLOTS; i++)
+  {
+    log_ring[i].sequence = i;
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, &log_thread, NULL);
 }
 
-void stringify_string(const char *json, jsmntok_t *t, char *dest, int *destpos)
+// This does not need to be used for strings read by jsmn, they are already escaped
+void append_escaped_json_string(struct HeapString *string, const char *input)
 {
-  dest[(*destpos)++] = '"';
-  strncpy(dest + *destpos, json + t->start, t->end - t->start);
-  *destpos += t->end - t->start;
-  dest[(*destpos)++] = '"';
+  for (const char *p = input; *p; p++)
+  {
+    if (*p == '\"' || *p == '\\')
+    {
+      heapStringAppendChar(string, '\\');
+    }
+    heapStringAppendChar(string, *p);
+  }
 }
 
-int stringify_inner(const char *json, jsmntok_t *tokens, int num_tokens, int pos, char *dest, int *destpos, char *extra_key, char *extra_value)
+// Like heapStringAppendString, for bytes that are not null terminated and whose length is already known
+static void heap_string_append_bytes(struct HeapString *string, const char *bytes, size_t length)
 {
+  heapStringReallocIfNeeded(string, string->length + length + 1);
+  memcpy(&string->contents[string->length], bytes, length);
+  string->length += length;
+  string->contents[string->length] = '\0';
+}
 
+// Writes the tokens as compact JSON. The extra key and value, when given, are added first in the outermost object
+int stringify_inner(const char *json, jsmntok_t *tokens, int num_tokens, int pos, struct HeapString *dest, const char *extra_key, int extra_key_length, const char *extra_value, int extra_value_length)
+{
   jsmntok_t *t = &tokens[pos];
   if (t->type == JSMN_STRING)
   {
-    stringify_string(json, t, dest, destpos);
+    heap_string_append_bytes(dest, json + t->start - 1, t->end - t->start + 2); // Including the quotes
     return 1; // Tokens handled
   }
   else if (t->type == JSMN_PRIMITIVE)
   {
-    stringify_primitive(json, t, dest, destpos);
+    heap_string_append_bytes(dest, json + t->start, t->end - t->start);
     return 1; // Tokens handled
   }
 
@@ -91,57 +243,54 @@ int stringify_inner(const char *json, jsmntok_t *tokens, int num_tokens, int pos
 
   if (t->type == JSMN_OBJECT)
   {
-    dest[(*destpos)++] = '{';
+    heapStringAppendChar(dest, '{');
     if (extra_key != NULL)
     {
-      dest[(*destpos)++] = '"';
-      strncpy(dest + *destpos, extra_key, strlen(extra_key));
-      *destpos += strlen(extra_key);
-      dest[(*destpos)++] = '"';
-      dest[(*destpos)++] = ':';
-      dest[(*destpos)++] = '"';
-      strncpy(dest + *destpos, extra_value, strlen(extra_value));
-      *destpos += strlen(extra_value);
-      dest[(*destpos)++] = '"';
+      heapStringAppendChar(dest, '"');
+      heap_string_append_bytes(dest, extra_key, extra_key_length);
+      heap_string_append_bytes(dest, "\":\"", 3);
+      heap_string_append_bytes(dest, extra_value, extra_value_length);
+      heapStringAppendChar(dest, '"');
       if (count > 0)
       {
-        dest[(*destpos)++] = ',';
+        heapStringAppendChar(dest, ',');
       }
     }
     for (i = 0, j = pos + 1; i < count; i++)
     {
-      j += stringify_inner(json, tokens, num_tokens, j, dest, destpos, NULL, NULL); // Key
-      dest[(*destpos)++] = ':';
-      j += stringify_inner(json, tokens, num_tokens, j, dest, destpos, NULL, NULL); // Value
+      j += stringify_inner(json, tokens, num_tokens, j, dest, NULL, 0, NULL, 0); // Key
+      heapStringAppendChar(dest, ':');
+      j += stringify_inner(json, tokens, num_tokens, j, dest, NULL, 0, NULL, 0); // Value
       if (i < count - 1)
       {
-        dest[(*destpos)++] = ',';
+        heapStringAppendChar(dest, ',');
       }
     }
-    dest[(*destpos)++] = '}';
+    heapStringAppendChar(dest, '}');
   }
   else if (t->type == JSMN_ARRAY)
   {
-    dest[(*destpos)++] = '[';
+    heapStringAppendChar(dest, '[');
     for (i = 0, j = pos + 1; i < count; i++)
     {
-      j += stringify_inner(json, tokens, num_tokens, j, dest, destpos, NULL, NULL); // Element
+      j += stringify_inner(json, tokens, num_tokens, j, dest, NULL, 0, NULL, 0); // Element
       if (i < count - 1)
       {
-        dest[*destpos] = ',';
-        (*destpos)++;
+        heapStringAppendChar(dest, ',');
       }
     }
-    dest[(*destpos)++] = ']';
+    heapStringAppendChar(dest, ']');
   }
   return j - pos; // Return number of tokens processed in this call
 }
 
-int stringify(const char *json, jsmntok_t *tokens, int num_tokens, int pos, char *dest, int *destpos, char *extra_key, char *extra_value)
+int stringify(const char *json, jsmntok_t *tokens, int num_tokens, int pos, struct HeapString *dest, const char *extra_key, const char *extra_value)
 {
-  int n = stringify_inner(json, tokens, num_tokens, pos, dest, destpos, extra_key, extra_value);
-  dest[*destpos] = '\0';
-  return n;
+  int extra_key_length = extra_key ? (int)strlen(extra_key) : 0;
+  int extra_value_length = extra_value ? (int)strlen(extra_value) : 0;
+  // Compact JSON is never longer than the input, so this is the only allocation needed
+  heapStringReallocIfNeeded(dest, dest->length + (tokens[pos].end - tokens[pos].start) + extra_key_length + extra_value_length + 7);
+  return stringify_inner(json, tokens, num_tokens, pos, dest, extra_key, extra_key_length, extra_value, extra_value_length);
 }
 
 void generateHexId(uint64_t seq, char *idBuffer)
@@ -149,24 +298,144 @@ void generateHexId(uint64_t seq, char *idBuffer)
   snprintf(idBuffer, 25, "%024" PRIx64, seq);
 }
 
-long get_process_memory_usage()
+// Resource usage of the server process, -1 where the platform does not report a value
+typedef struct
 {
-  char cmd[64];
-  FILE *pipe;
-  long rss = 0;
+  long long resident_bytes;
+  long long virtual_bytes;
+  long long peak_resident_bytes;
+  long threads;
+  long open_files;
+  double user_cpu_seconds;
+  double system_cpu_seconds;
+} ddb_process_stats;
 
-  sprintf(cmd, "ps -o rss= -p %d", getpid());
+// Read from /proc and getrusage rather than by running ps, /status is polled often and forking stalls every thread
+void get_process_stats(ddb_process_stats *stats)
+{
+  stats->resident_bytes = -1;
+  stats->virtual_bytes = -1;
+  stats->peak_resident_bytes = -1;
+  stats->threads = -1;
+  stats->open_files = -1;
+  stats->user_cpu_seconds = -1;
+  stats->system_cpu_seconds = -1;
+#ifndef _WIN32
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+  {
+    stats->user_cpu_seconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    stats->system_cpu_seconds = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#ifdef __APPLE__
+    stats->peak_resident_bytes = usage.ru_maxrss; // Already in bytes on macOS
+#else
+    stats->peak_resident_bytes = (long long)usage.ru_maxrss * 1024;
+#endif
+  }
+#endif
+#ifdef __linux__
+  long page_size = sysconf(_SC_PAGESIZE);
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm != NULL)
+  {
+    long long size, resident;
+    if (fscanf(statm, "%lld %lld", &size, &resident) == 2)
+    {
+      stats->virtual_bytes = size * page_size;
+      stats->resident_bytes = resident * page_size;
+    }
+    fclose(statm);
+  }
 
-  pipe = popen(cmd, "r");
-  if (pipe == NULL)
+  FILE *stat_file = fopen("/proc/self/stat", "r");
+  if (stat_file != NULL)
   {
-    printf("Failed to run command\n");
-    return 0;
+    char line[1024];
+    size_t length = fread(line, 1, sizeof(line) - 1, stat_file);
+    line[length] = '\0';
+    fclose(stat_file);
+    // The command name in field 2 may contain spaces, so fields are counted from its closing parenthesis
+    char *field = strrchr(line, ')');
+    for (int number = 2; field != NULL && number < 20; number++)
+    {
+      field = strchr(field + 1, ' ');
+    }
+    if (field != NULL)
+    {
+      stats->threads = strtol(field + 1, NULL, 10);
+    }
+  }
+
+  DIR *fds = opendir("/proc/self/fd");
+  if (fds != NULL)
+  {
+    long open_files = 0;
+    struct dirent *entry;
+    while ((entry = readdir(fds)) != NULL)
+    {
+      if (entry->d_name[0] != '.')
+      {
+        open_files++;
+      }
+    }
+    closedir(fds);
+    stats->open_files = open_files - 1; // Not counting the descriptor used for the listing
   }
-  fscanf(pipe, "%ld", &rss);
-  pclose(pipe);
+#else
+  // Without /proc the peak is the closest thing to the current resident size
+  stats->resident_bytes = stats->peak_resident_bytes;
+#endif
+}
 
-  return rss * 1024; // Convert kilobytes to bytes
+// How much of a file is in the OS page cache, so reads will not touch the disk. -1 if unknown
+long long get_file_cached_bytes(const char *filename)
+{
+#ifdef _WIN32
+  return -1;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  if (statbuf.st_size == 0)
+  {
+    close(fd);
+    return 0;
+  }
+  size_t size = (size_t)statbuf.st_size;
+  // Mapping does not read anything, mincore only reports which pages are already resident
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    return -1;
+  }
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  size_t num_pages = (size + page_size - 1) / page_size;
+  unsigned char *residency = malloc(num_pages);
+  long long cached_bytes = -1;
+  if (residency != NULL && mincore(mapping, size, (void *)residency) == 0)
+  {
+    cached_bytes = 0;
+    for (size_t page = 0; page < num_pages; page++)
+    {
+      if (residency[page] & 1)
+      {
+        cached_bytes += page == num_pages - 1 ? size - page * page_size : page_size;
+      }
+    }
+  }
+  free(residency);
+  munmap(mapping, size);
+  return cached_bytes;
+#endif
 }
 
 long long get_file_size(const char *filename)
@@ -215,15 +484,22 @@ void test_stringify() {
 
   printf("%d\n", num_tokens);
   printf("%d\n", tokens[0].type);
-  char dest[10240]; // Large enough buffer for the output
-  int destpos = 0;
-  stringify(json_string, tokens, num_tokens, 0, dest, &destpos);
-  dest[destpos] = '\0'; // Null-terminate the output string
-  printf("%s\n", dest);
+  struct HeapString dest;
+  heapStringInit(&dest);
+  stringify(json_string, tokens, num_tokens, 0, &dest, NULL, NULL);
+  printf("%s\n", dest.contents);
+  heapStringFreeContents(&dest);
 }
 */
 
+static int get_token_index_by_key_length(const char *key, int key_length, int parent, const char *js_buffer, jsmntok_t *tokens, int number_of_tokens);
+
 static int get_token_index_by_key(char *key, int parent, const char *js_buffer, jsmntok_t *tokens, int number_of_tokens)
+{
+  return get_token_index_by_key_length(key, (int)strlen(key), parent, js_buffer, tokens, number_of_tokens);
+}
+
+static int get_token_index_by_key_length(const char *key, int key_length, int parent, const char *js_buffer, jsmntok_t *tokens, int number_of_tokens)
 {
   if (number_of_tokens == 0)
   {
@@ -247,7 +523,7 @@ static int get_token_index_by_key(char *key, int parent, const char *js_buffer,
     if (t->type == JSMN_STRING &&
         t->size == 1 &&
         t->parent == parent &&
-        (int)strlen(key) == t->end - t->start &&
+        key_length == t->end - t->start &&
         strncmp(key, &js_buffer[t->start], t->end - t->start) == 0)
     {
       return i + 1;
@@ -257,641 +533,4362 @@ static int get_token_index_by_key(char *key, int parent, const char *js_buffer,
   return -1;
 }
 
-const char *db_file_name = "default.ddb.json";
+// Tokens are ordered by start position, so the subtree of a token ends at the first token starting after it
+static int next_sibling_token(jsmntok_t *tokens, int number_of_tokens, int index)
+{
+  int end = tokens[index].end;
+  int i = index + 1;
+  while (i < number_of_tokens && tokens[i].start < end)
+  {
+    i++;
+  }
+  return i;
+}
 
-void reset_file()
+static bool tokens_are_equal(const char *a_json, jsmntok_t *a, const char *b_json, jsmntok_t *b)
 {
-  FILE *file;
-  file = fopen(db_file_name, "w");
-  if (file)
+  return a->type == b->type &&
+         a->end - a->start == b->end - b->start &&
+         memcmp(a_json + a->start, b_json + b->start, a->end - a->start) == 0;
+}
+
+// Most documents and request bodies fit in this many tokens on the stack
+#define STACK_TOKENS 256
+
+// Parses into *tokens when *capacity is enough. Otherwise the tokens are counted in a first pass and a big enough
+// array is allocated, which the caller frees when *tokens no longer is its own array
+static int parse_json_tokens(const char *json, size_t length, jsmntok_t **tokens, int *capacity)
+{
+  jsmn_parser parser;
+  jsmn_init(&parser);
+  int num_tokens = *capacity > 0 ? jsmn_parse(&parser, json, length, *tokens, *capacity) : JSMN_ERROR_NOMEM;
+  if (num_tokens != JSMN_ERROR_NOMEM)
   {
-    fprintf(file, "[\n]");
-    fclose(file);
-    printf("Did reset!\n");
+    return num_tokens;
   }
-  else
+  jsmn_init(&parser);
+  int needed = jsmn_parse(&parser, json, length, NULL, 0);
+  if (needed < 1)
   {
-    printf("Couldn't open file to do reset!\n");
+    return needed;
   }
+  size_t size = needed * sizeof(jsmntok_t);
+  *tokens = (jsmntok_t *)malloc(size);
+  *capacity = needed;
+  jsmn_init(&parser);
+  return jsmn_parse(&parser, json, length, *tokens, *capacity);
 }
 
-void add_document_to_file(const char *jsonString)
+// Only equality on the top level fields of the filter so far, {} matches everything
+static bool document_tokens_match_filter(const char *document, jsmntok_t *tokens, int num_tokens, const char *filter_json, jsmntok_t *filter_tokens, int num_filter_tokens, int filter_index)
 {
-  FILE *file;
-
-  // Attempt to open the file in read+update mode, this does not truncate the file
-  file = fopen(db_file_name, "r+");
-  if (!file)
+  if (num_tokens < 1)
   {
-    // File does not exist, create it
-    file = fopen(db_file_name, "w");
-    if (file)
-    {
-      fclose(file);
-    }
-    else
-    {
-      perror("Failed to create file");
-      exit(EXIT_FAILURE);
-    }
-    file = fopen(db_file_name, "r+");
+    return false;
   }
-  if (file)
+  for (int i = 0, k = filter_index + 1; i < filter_tokens[filter_index].size; i++)
   {
-    // File exists, find the position of the last character
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-
-    if (fileSize <= 2)
-    {
-      // File is empty or wrongly formatted; start a new JSON array
-      fseek(file, 0, SEEK_SET);
-      // fprint(file, "[");
-      fputs("[", file);
-    }
-    else
+    jsmntok_t *key = &filter_tokens[k];
+    jsmntok_t *value = &filter_tokens[k + 1];
+    int document_value_index = get_token_index_by_key_length(filter_json + key->start, key->end - key->start, 0, document, tokens, num_tokens);
+    if (document_value_index < 0 || !tokens_are_equal(document, &tokens[document_value_index], filter_json, value))
     {
-      // Seek to the last two characters, which should be "\n]"
-      fseek(file, -2, SEEK_END);
-      // Only add the comma if there's at least one object in the file
-      if (ftell(file) > 1)
-      {
-        fputs(",", file);
-      }
+      return false;
     }
-    fprintf(file, "\n{\"s\":1,\"d\":%s}\n]", jsonString);
-    fclose(file);
+    k = next_sibling_token(filter_tokens, num_filter_tokens, k + 1);
   }
+  return true;
 }
 
-typedef struct
-{
-  jsmn_stream_parser *parser;
-  // The stuff we want after documents are parsed
-  long document_container_start;
-  long document_container_end;
-  long document_start;
-  long document_end;
-  long s_pos;
-  int document_s;
-  char document_id[ID_LENGTH + 1];
-  // State machine for extracting the interesting stuff
-  long pos;
-  bool in_document_container;
-  bool in_document;
-  bool next_is_s;
-  bool next_is_document;
-  bool next_is_id;
-  bool document_read;
-} ddb_document_parse_state;
-
-void print_document_parse_state(ddb_document_parse_state *state)
+bool document_matches_filter(const char *document, int document_length, const char *filter_json, jsmntok_t *filter_tokens, int num_filter_tokens, int filter_index)
 {
-  // printf("In document container: %d\n", state->in_document_container);
-  // printf("In document: %d\n", state->in_document);
-  //  printf("Next is s: %d\n", state->next_is_s);
-  //  printf("Next is document: %d\n", state->next_is_document);
-  //  printf("Next is id: %d\n", state->next_is_id);
-  printf("Document s: %d\n", state->document_s);
-  printf("Document id: %s\n", state->document_id);
-  printf("Document start pos: %ld\n", state->document_start);
-  printf("Document end pos: %ld\n\n", state->document_end);
-  printf("Document container start pos: %ld\n", state->document_container_start);
-  printf("Document container end pos: %ld\n\n", state->document_container_end);
+  int filter_fields = filter_tokens[filter_index].size;
+  if (filter_fields == 0)
+  {
+    return true;
+  }
+  jsmntok_t stack_tokens[STACK_TOKENS];
+  jsmntok_t *tokens = stack_tokens;
+  int capacity = STACK_TOKENS;
+  int num_tokens = parse_json_tokens(document, document_length, &tokens, &capacity);
+  bool matches = document_tokens_match_filter(document, tokens, num_tokens, filter_json, filter_tokens, num_filter_tokens, filter_index);
+  if (tokens != stack_tokens)
+  {
+    free(tokens);
+  }
+  return matches;
 }
 
-void start_arr(void *user_arg)
+// Strings tokens don't include the quotes, but they are needed when copying values as they are
+static void append_raw_token(struct HeapString *string, const char *json, jsmntok_t *t)
 {
-  // ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
-  // printf("Array started.\n");
+  int quote = t->type == JSMN_STRING ? 1 : 0;
+  heap_string_append_bytes(string, json + t->start - quote, t->end - t->start + 2 * quote);
 }
-void end_arr(void *user_arg)
+
+static int compare_keys(const char *json, jsmntok_t *a, jsmntok_t *b)
 {
-  // printf("Array ended\n");
+  int a_length = a->end - a->start;
+  int b_length = b->end - b->start;
+  int result = memcmp(json + a->start, json + b->start, a_length < b_length ? a_length : b_length);
+  return result != 0 ? result : a_length - b_length;
 }
-void start_obj(void *user_arg)
+
+// Compact JSON, with the top level keys sorted when sort_keys is set. Nested objects keep their order
+// since filters compare them as written.
+void canonicalize_json(const char *json, jsmntok_t *tokens, int num_tokens, int index, bool sort_keys, struct HeapString *canonical)
 {
-  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
-  // print_document_parse_state(document_parse_state);
-  // printf("= Object started\n");
-  document_parse_state->in_document_container = (document_parse_state->parser->stack_height == 1);
-  if (document_parse_state->in_document_container)
-  {
-    document_parse_state->document_container_start = document_parse_state->pos;
-    document_parse_state->document_container_end = -1;
-    document_parse_state->document_start = -1;
-    document_parse_state->document_end = -1;
-    document_parse_state->s_pos = -1;
-    document_parse_state->document_s = 0;
-    document_parse_state->document_id[0] = '\0';
-  }
-  else if (document_parse_state->next_is_document)
+  jsmntok_t *t = &tokens[index];
+  if (t->type == JSMN_OBJECT)
   {
-    document_parse_state->in_document = true;
-    document_parse_state->next_is_document = false;
-    document_parse_state->document_start = document_parse_state->pos;
+    int key_indexes_on_stack[32];
+    int *key_indexes = t->size <= 32 ? key_indexes_on_stack : (int *)malloc(t->size * sizeof(int));
+    for (int i = 0, k = index + 1; i < t->size; i++)
+    {
+      // Insertion sort, objects in filters are small
+      int j = i;
+      while (sort_keys && j > 0 && compare_keys(json, &tokens[key_indexes[j - 1]], &tokens[k]) > 0)
+      {
+        key_indexes[j] = key_indexes[j - 1];
+        j--;
+      }
+      key_indexes[j] = k;
+      k = next_sibling_token(tokens, num_tokens, k + 1);
+    }
+    heapStringAppendChar(canonical, '{');
+    for (int i = 0; i < t->size; i++)
+    {
+      if (i > 0)
+      {
+        heapStringAppendChar(canonical, ',');
+      }
+      append_raw_token(canonical, json, &tokens[key_indexes[i]]);
+      heapStringAppendChar(canonical, ':');
+      canonicalize_json(json, tokens, num_tokens, key_indexes[i] + 1, false, canonical);
+    }
+    heapStringAppendChar(canonical, '}');
+    if (key_indexes != key_indexes_on_stack)
+    {
+      free(key_indexes);
+    }
   }
-}
-void end_obj(void *user_arg)
-{
-  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
-  if (document_parse_state->in_document)
+  else if (t->type == JSMN_ARRAY)
   {
-    if (document_parse_state->parser->stack_height == 4)
+    heapStringAppendChar(canonical, '[');
+    for (int i = 0, j = index + 1; i < t->size; i++)
     {
-      document_parse_state->document_end = document_parse_state->pos + 1;
-      document_parse_state->in_document = false;
+      if (i > 0)
+      {
+        heapStringAppendChar(canonical, ',');
+      }
+      canonicalize_json(json, tokens, num_tokens, j, false, canonical);
+      j = next_sibling_token(tokens, num_tokens, j);
     }
+    heapStringAppendChar(canonical, ']');
   }
-  if (
-      document_parse_state->parser->stack_height == 2)
+  else
   {
-    document_parse_state->document_container_end = document_parse_state->pos + 1;
-    document_parse_state->in_document_container = false;
-    document_parse_state->document_read = true;
+    append_raw_token(canonical, json, t);
   }
 }
 
-void obj_key(const char *key, size_t key_len, void *user_arg)
+static bool parse_integer_token(const char *json, jsmntok_t *t, long long *value)
 {
-  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
-  if (document_parse_state->in_document_container)
+  char number[32];
+  int length = t->end - t->start;
+  if (t->type != JSMN_PRIMITIVE || length == 0 || length >= (int)sizeof(number))
   {
-    if (strcmp(key, "s") == 0)
-    {
+    return false;
+  }
+  memcpy(number, json + t->start, length);
+  number[length] = '\0';
+  char *end;
+  errno = 0;
+  *value = strtoll(number, &end, 10);
+  return errno == 0 && end == number + length;
+}
+
+// False when the sum doesn't fit in a long long, a wrapped counter would be written otherwise
+static bool add_increment(long long value, long long increment, long long *sum)
+{
+  return !__builtin_add_overflow(value, increment, sum);
+}
+
+typedef struct
+{
+  int set_index;
+  int unset_index;
+  int inc_index;
+} ddb_update_operators;
+
+// Returns -1 for unknown operators, or if they try to change _id
+static int get_update_operators(const char *update_json, jsmntok_t *update_tokens, int num_update_tokens, int update_index, ddb_update_operators *operators)
+{
+  operators->set_index = -1;
+  operators->unset_index = -1;
+  operators->inc_index = -1;
+  for (int i = 0, k = update_index + 1; i < update_tokens[update_index].size; i++)
+  {
+    jsmntok_t *key = &update_tokens[k];
+    int key_length = key->end - key->start;
+    if (update_tokens[k + 1].type != JSMN_OBJECT ||
+        get_token_index_by_key("_id", k + 1, update_json, update_tokens, num_update_tokens) != -1)
+    {
+      return -1;
+    }
+    if (key_length == 4 && 0 == strncmp(update_json + key->start, "$set", 4))
+    {
+      operators->set_index = k + 1;
+    }
+    else if (key_length == 6 && 0 == strncmp(update_json + key->start, "$unset", 6))
+    {
+      operators->unset_index = k + 1;
+    }
+    else if (key_length == 4 && 0 == strncmp(update_json + key->start, "$inc", 4))
+    {
+      operators->inc_index = k + 1;
+    }
+    else
+    {
+      return -1;
+    }
+    k = next_sibling_token(update_tokens, num_update_tokens, k + 1);
+  }
+  return 0;
+}
+
+static int get_operator_value_index(int operator_index, const char *key, int key_length, const char *update_json, jsmntok_t *update_tokens, int num_update_tokens)
+{
+  if (operator_index == -1)
+  {
+    return -1;
+  }
+  return get_token_index_by_key_length(key, key_length, operator_index, update_json, update_tokens, num_update_tokens);
+}
+
+// Builds the updated document from the $set, $unset and $inc operators, only top level fields so far
+// Returns 0 on success, -1 if the update has an unknown operator, tries to change _id or increments something that isn't an integer,
+// and -2 if an increment overflows
+static int apply_update_to_tokens(const char *document, jsmntok_t *tokens, int num_tokens, const char *update_json, jsmntok_t *update_tokens, int num_update_tokens, int update_index, struct HeapString *updated)
+{
+  ddb_update_operators operators;
+  if (get_update_operators(update_json, update_tokens, num_update_tokens, update_index, &operators) != 0)
+  {
+    return -1;
+  }
+  if (num_tokens < 1 || tokens[0].type != JSMN_OBJECT)
+  {
+    return -1;
+  }
+
+  bool first = true;
+  heapStringAppendChar(updated, '{');
+  // Existing fields keep their order, set and incremented ones get their new value in place
+  for (int i = 0, k = 1; i < tokens[0].size; i++)
+  {
+    jsmntok_t *key = &tokens[k];
+    const char *key_name = document + key->start;
+    int key_length = key->end - key->start;
+    int next = next_sibling_token(tokens, num_tokens, k + 1);
+    if (get_operator_value_index(operators.unset_index, key_name, key_length, update_json, update_tokens, num_update_tokens) == -1)
+    {
+      int set_value_index = get_operator_value_index(operators.set_index, key_name, key_length, update_json, update_tokens, num_update_tokens);
+      int inc_value_index = get_operator_value_index(operators.inc_index, key_name, key_length, update_json, update_tokens, num_update_tokens);
+      if (!first)
+      {
+        heapStringAppendChar(updated, ',');
+      }
+      first = false;
+      append_raw_token(updated, document, key);
+      heapStringAppendChar(updated, ':');
+      if (set_value_index != -1)
+      {
+        stringify_inner(update_json, update_tokens, num_update_tokens, set_value_index, updated, NULL, 0, NULL, 0);
+      }
+      else if (inc_value_index != -1)
+      {
+        long long value, increment, sum;
+        if (!parse_integer_token(document, &tokens[k + 1], &value) ||
+            !parse_integer_token(update_json, &update_tokens[inc_value_index], &increment))
+        {
+          return -1;
+        }
+        if (!add_increment(value, increment, &sum))
+        {
+          return -2;
+        }
+        heapStringAppendFormat(updated, "%lld", sum);
+      }
+      else
+      {
+        append_raw_token(updated, document, &tokens[k + 1]);
+      }
+    }
+    k = next;
+  }
+  // Then the set and incremented fields the document didn't have
+  int added_operators[] = {operators.set_index, operators.inc_index};
+  for (int o = 0; o < 2; o++)
+  {
+    int operator_index = added_operators[o];
+    if (operator_index == -1)
+    {
+      continue;
+    }
+    for (int i = 0, k = operator_index + 1; i < update_tokens[operator_index].size; i++)
+    {
+      jsmntok_t *key = &update_tokens[k];
+      if (get_token_index_by_key_length(update_json + key->start, key->end - key->start, 0, document, tokens, num_tokens) == -1 &&
+          (operator_index == operators.set_index ||
+           get_operator_value_index(operators.set_index, update_json + key->start, key->end - key->start, update_json, update_tokens, num_update_tokens) == -1))
+      {
+        if (!first)
+        {
+          heapStringAppendChar(updated, ',');
+        }
+        first = false;
+        append_raw_token(updated, update_json, key);
+        heapStringAppendChar(updated, ':');
+        if (operator_index == operators.inc_index)
+        {
+          long long increment;
+          if (!parse_integer_token(update_json, &update_tokens[k + 1], &increment))
+          {
+            return -1;
+          }
+          heapStringAppendFormat(updated, "%lld", increment);
+        }
+        else
+        {
+          stringify_inner(update_json, update_tokens, num_update_tokens, k + 1, updated, NULL, 0, NULL, 0);
+        }
+      }
+      k = next_sibling_token(update_tokens, num_update_tokens, k + 1);
+    }
+  }
+  heapStringAppendChar(updated, '}');
+  return 0;
+}
+
+int apply_update(const char *document, int document_length, const char *update_json, jsmntok_t *update_tokens, int num_update_tokens, int update_index, struct HeapString *updated)
+{
+  jsmntok_t stack_tokens[STACK_TOKENS];
+  jsmntok_t *tokens = stack_tokens;
+  int capacity = STACK_TOKENS;
+  int num_tokens = parse_json_tokens(document, document_length, &tokens, &capacity);
+  int result = apply_update_to_tokens(document, tokens, num_tokens, update_json, update_tokens, num_update_tokens, update_index, updated);
+  if (tokens != stack_tokens)
+  {
+    free(tokens);
+  }
+  return result;
+}
+
+// Appends the pairs of the object at object_index to an object being built, with a comma before each one but the first
+static void append_object_pairs(struct HeapString *object, bool *first, const char *json, jsmntok_t *tokens, int num_tokens, int object_index)
+{
+  for (int i = 0, k = object_index + 1; i < tokens[object_index].size; i++)
+  {
+    heapStringAppendString(object, *first ? "" : ",");
+    *first = false;
+    append_raw_token(object, json, &tokens[k]);
+    heapStringAppendChar(object, ':');
+    stringify_inner(json, tokens, num_tokens, k + 1, object, NULL, 0, NULL, 0);
+    k = next_sibling_token(tokens, num_tokens, k + 1);
+  }
+}
+
+// The update as followers replay it, with every $inc turned into a $set of the value it gave in the updated document.
+// $set and $unset leave the same document when they are applied twice, $inc doesn't. False when the updated document
+// lacks an incremented field
+static bool update_for_replay(const char *update_json, jsmntok_t *update_tokens, int num_update_tokens, int update_index, const char *document,
+                              int document_length, struct HeapString *replay)
+{
+  ddb_update_operators operators;
+  get_update_operators(update_json, update_tokens, num_update_tokens, update_index, &operators);
+  jsmntok_t stack_tokens[STACK_TOKENS];
+  jsmntok_t *tokens = stack_tokens;
+  int capacity = STACK_TOKENS;
+  int num_tokens = parse_json_tokens(document, document_length, &tokens, &capacity);
+  bool complete = num_tokens >= 1 && tokens[0].type == JSMN_OBJECT;
+  bool first = true;
+  heapStringAppendString(replay, "{\"$set\":{");
+  if (operators.set_index != -1)
+  {
+    append_object_pairs(replay, &first, update_json, update_tokens, num_update_tokens, operators.set_index);
+  }
+  for (int i = 0, k = operators.inc_index + 1; complete && operators.inc_index != -1 && i < update_tokens[operators.inc_index].size; i++)
+  {
+    const char *key = update_json + update_tokens[k].start;
+    int key_length = update_tokens[k].end - update_tokens[k].start;
+    int value_index = get_token_index_by_key_length(key, key_length, 0, document, tokens, num_tokens);
+    complete = value_index != -1;
+    // A field that is also set has the value of the $set already
+    if (value_index != -1 && get_operator_value_index(operators.set_index, key, key_length, update_json, update_tokens, num_update_tokens) == -1)
+    {
+      heapStringAppendString(replay, first ? "" : ",");
+      first = false;
+      append_raw_token(replay, update_json, &update_tokens[k]);
+      heapStringAppendChar(replay, ':');
+      append_raw_token(replay, document, &tokens[value_index]);
+    }
+    k = next_sibling_token(update_tokens, num_update_tokens, k + 1);
+  }
+  heapStringAppendChar(replay, '}');
+  if (operators.unset_index != -1)
+  {
+    heapStringAppendString(replay, ",\"$unset\":");
+    stringify(update_json, update_tokens, num_update_tokens, operators.unset_index, replay, NULL, NULL);
+  }
+  heapStringAppendChar(replay, '}');
+  if (tokens != stack_tokens)
+  {
+    free(tokens);
+  }
+  return complete;
+}
+
+// The fast path for counters. When the update only has $inc and the document with the new values still fits in the
+// capacity bytes of its container, it is built in updated and written where it is from the first counter on. The
+// container's padding takes a number that got longer, and spaces are written over what a shorter one left.
+// Overflows are left to apply_update, which refuses them
+static bool increment_tokens_in_place(FILE *file, long document_start, long capacity, const char *document, int document_length, jsmntok_t *tokens, int num_tokens,
+                                      const char *update_json, jsmntok_t *update_tokens, int num_update_tokens, int update_index, struct HeapString *updated)
+{
+  ddb_update_operators operators;
+  if (get_update_operators(update_json, update_tokens, num_update_tokens, update_index, &operators) != 0 ||
+      operators.inc_index == -1 || operators.set_index != -1 || operators.unset_index != -1)
+  {
+    return false;
+  }
+  int counters = update_tokens[operators.inc_index].size;
+  long long values[16];
+  int slot_starts[16];
+  int slot_ends[16];
+  if (counters > 16)
+  {
+    return false;
+  }
+  if (num_tokens < 1)
+  {
+    return false;
+  }
+  for (int i = 0, k = operators.inc_index + 1; i < counters; i++)
+  {
+    jsmntok_t *key = &update_tokens[k];
+    int value_index = get_token_index_by_key_length(update_json + key->start, key->end - key->start, 0, document, tokens, num_tokens);
+    long long increment;
+    if (value_index == -1 ||
+        !parse_integer_token(document, &tokens[value_index], &values[i]) ||
+        !parse_integer_token(update_json, &update_tokens[k + 1], &increment) ||
+        !add_increment(values[i], increment, &values[i]))
+    {
+      return false;
+    }
+    // The slot is the value and the whitespace between it and the colon, which older versions padded counters with
+    int slot_start = tokens[value_index].start;
+    while (slot_start > 0 && document[slot_start - 1] == ' ')
+    {
+      slot_start--;
+    }
+    // Kept in the order they are in the document
+    int j = i;
+    for (; j > 0 && slot_starts[j - 1] > slot_start; j--)
+    {
+      slot_starts[j] = slot_starts[j - 1];
+      slot_ends[j] = slot_ends[j - 1];
+      long long value = values[j - 1];
+      values[j - 1] = values[j];
+      values[j] = value;
+    }
+    if (j > 0 && slot_starts[j - 1] == slot_start)
+    {
+      return false;
+    }
+    slot_starts[j] = slot_start;
+    slot_ends[j] = tokens[value_index].end;
+    k = next_sibling_token(update_tokens, num_update_tokens, k + 1);
+  }
+  int copied = 0;
+  for (int i = 0; i < counters; i++)
+  {
+    heap_string_append_bytes(updated, document + copied, slot_starts[i] - copied);
+    heapStringAppendFormat(updated, "%lld", values[i]);
+    copied = slot_ends[i];
+  }
+  heap_string_append_bytes(updated, document + copied, document_length - copied);
+  if ((long)updated->length > capacity)
+  {
+    return false;
+  }
+  fseek(file, document_start + slot_starts[0], SEEK_SET);
+  fwrite(updated->contents + slot_starts[0], 1, updated->length - slot_starts[0], file);
+  for (int i = (int)updated->length; i < document_length; i++)
+  {
+    fputc(' ', file);
+  }
+  return true;
+}
+
+static bool increment_in_place(FILE *file, long document_start, long capacity, const char *document, int document_length, const char *update_json, jsmntok_t *update_tokens,
+                               int num_update_tokens, int update_index, struct HeapString *updated)
+{
+  jsmntok_t stack_tokens[STACK_TOKENS];
+  jsmntok_t *tokens = stack_tokens;
+  int capacity_tokens = STACK_TOKENS;
+  int num_tokens = parse_json_tokens(document, document_length, &tokens, &capacity_tokens);
+  bool incremented = increment_tokens_in_place(file, document_start, capacity, document, document_length, tokens, num_tokens, update_json, update_tokens, num_update_tokens,
+                                               update_index, updated);
+  if (tokens != stack_tokens)
+  {
+    free(tokens);
+  }
+  return incremented;
+}
+
+// The collection is split into segment files that each hold a JSON array of containers. The first one is the file_name
+// of the collection and the others are numbered after it, like default.1.ddb.json. Inserts go to the last segment until it has grown to
+// segment_bytes, then a new one is started. The older segments only change when one of their documents is updated or
+// deleted, and a delete only rewrites the segment the document is in
+typedef struct
+{
+  char file_name[1024];
+  uint64_t min_id; // Sequence numbers of the lowest and highest _id in the segment, min_id > max_id when there are none
+  uint64_t max_id;
+  uint64_t live_documents;
+} ddb_segment;
+
+// Where a document was last found, so hot documents like counters can be updated without scanning the file.
+// Every function that moves, rewrites or deletes a document forgets it here
+typedef struct
+{
+  char document_id[ID_LENGTH + 1];
+  int segment;
+  long document_container_start;
+  long document_container_end;
+  long document_start;
+  long document_end;
+  long s_pos;
+} ddb_document_location;
+
+#define LOCATION_HINTS 4096
+
+// Recently read and written documents, least recently used ones are evicted to stay within the budget
+typedef struct ddb_cache_entry
+{
+  char document_id[ID_LENGTH + 1];
+  char *document;
+  size_t length;
+  struct ddb_cache_entry *hash_next;
+  struct ddb_cache_entry *more_recent;
+  struct ddb_cache_entry *less_recent;
+} ddb_cache_entry;
+
+typedef struct
+{
+  size_t budget; // 0 disables the cache
+  size_t resident_bytes;
+  uint64_t documents;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  ddb_cache_entry **buckets;
+  size_t bucket_count;
+  ddb_cache_entry *most_recent;
+  ddb_cache_entry *least_recent;
+} ddb_document_cache;
+
+// Results of find and count, keyed by the endpoint and the canonical filter
+typedef struct
+{
+  char *key;
+  char *result;
+  size_t result_length;
+  uint64_t generation;
+} ddb_query_cache_entry;
+
+#define QUERY_CACHE_SLOTS 256
+
+typedef struct
+{
+  size_t budget; // 0 disables the cache
+  size_t resident_bytes;
+  uint64_t hits;
+  uint64_t misses;
+  ddb_query_cache_entry entries[QUERY_CACHE_SLOTS];
+} ddb_query_cache;
+
+#define COLLECTION_NAME_LENGTH 64
+
+// Everything about one collection. Collections only share the process, each one has its own files, sequence numbers,
+// caches and lock, so requests to different collections never wait for each other
+typedef struct ddb_collection
+{
+  char name[COLLECTION_NAME_LENGTH + 1];
+  // With --partitions the documents are spread over partitions that are each a ddb_collection with their own files,
+  // sequence numbers, caches and lock. A document belongs to partition (sequence number - 1) % num_partitions.
+  // Without, partitions points to the collection itself. Partitions have partitions set to NULL
+  struct ddb_collection *partitions;
+  int num_partitions;
+  int partition_index; // Of this partition, whose sequence numbers step by num_partitions
+  int64_t next_insert_partition;
+  char file_name[1024]; // The first segment
+  char checkpoint_file_name[1024];
+  // Serializes all access to the files of the collection, the handlers run on one thread per connection
+  pthread_mutex_t lock;
+  uint64_t sequence_number;
+  // Bumped by every write, cached query results from an older generation are stale
+  uint64_t write_generation;
+  // Kept up to date by insert and delete so that counting never needs to read the file
+  ddb_document_counts document_counts;
+  ddb_segment *segments;
+  int num_segments;
+  bool checkpoint_on_disk;
+  long mutations_since_checkpoint;
+  ddb_document_location *location_hints; // LOCATION_HINTS of them
+  ddb_document_cache document_cache;
+  ddb_query_cache query_cache;
+} ddb_collection;
+
+// 0 keeps everything in one file
+static long long segment_bytes = 64 * 1024 * 1024;
+
+static void segment_file_name(ddb_collection *collection, int index, char *file_name, size_t size)
+{
+  const char *suffix = ".ddb.json";
+  size_t base_length = strlen(collection->file_name);
+  if (base_length >= strlen(suffix) && 0 == strcmp(collection->file_name + base_length - strlen(suffix), suffix))
+  {
+    base_length -= strlen(suffix);
+  }
+  else
+  {
+    suffix = "";
+  }
+  if (index == 0)
+  {
+    snprintf(file_name, size, "%s", collection->file_name);
+  }
+  else
+  {
+    snprintf(file_name, size, "%.*s.%d%s", (int)base_length, collection->file_name, index, suffix);
+  }
+}
+
+static ddb_segment *segment_add(ddb_collection *collection)
+{
+  collection->segments = (ddb_segment *)realloc(collection->segments, (collection->num_segments + 1) * sizeof(ddb_segment));
+  ddb_segment *segment = &collection->segments[collection->num_segments];
+  segment_file_name(collection, collection->num_segments, segment->file_name, sizeof(segment->file_name));
+  segment->min_id = UINT64_MAX;
+  segment->max_id = 0;
+  segment->live_documents = 0;
+  collection->num_segments++;
+  return segment;
+}
+
+// The first segment is always there, even before its file is created, the others are there as long as the numbering is unbroken
+void segments_discover(ddb_collection *collection)
+{
+  collection->num_segments = 0;
+  segment_add(collection);
+  char file_name[1024];
+  for (segment_file_name(collection, collection->num_segments, file_name, sizeof(file_name)); get_file_size(file_name) >= 0; segment_file_name(collection, collection->num_segments, file_name, sizeof(file_name)))
+  {
+    segment_add(collection);
+  }
+}
+
+static ddb_segment *active_segment(ddb_collection *collection)
+{
+  return &collection->segments[collection->num_segments - 1];
+}
+
+// The sequence number is in the last 16 digits, a router puts the number of the shard before it
+static uint64_t id_sequence_number(const char *_id)
+{
+  size_t length = strlen(_id);
+  uint64_t sequence = 0;
+  return sscanf(length > 16 ? _id + length - 16 : _id, "%" SCNx64, &sequence) == 1 ? sequence : 0;
+}
+
+static void segment_include_id(ddb_segment *segment, uint64_t sequence)
+{
+  if (sequence < segment->min_id)
+  {
+    segment->min_id = sequence;
+  }
+  if (sequence > segment->max_id)
+  {
+    segment->max_id = sequence;
+  }
+}
+
+// Lets _id lookups skip the segments that can't have the document
+static bool segment_may_contain(const ddb_segment *segment, const char *_id)
+{
+  uint64_t sequence = id_sequence_number(_id);
+  return sequence >= segment->min_id && sequence <= segment->max_id;
+}
+
+long long database_size(ddb_collection *collection)
+{
+  long long size = 0;
+  for (int i = 0; i < collection->num_segments; i++)
+  {
+    long long segment_size = get_file_size(collection->segments[i].file_name);
+    size += segment_size > 0 ? segment_size : 0;
+  }
+  return size;
+}
+
+long long database_cached_bytes(ddb_collection *collection)
+{
+  long long cached_bytes = 0;
+  for (int i = 0; i < collection->num_segments; i++)
+  {
+    long long segment_cached_bytes = get_file_cached_bytes(collection->segments[i].file_name);
+    if (segment_cached_bytes < 0)
+    {
+      return -1;
+    }
+    cached_bytes += segment_cached_bytes;
+  }
+  return cached_bytes;
+}
+
+#define CHECKPOINT_INTERVAL 1000
+
+// A checkpoint only describes the database file as it was when it was written, so it is
+// removed before the file is modified and written again every CHECKPOINT_INTERVAL mutations
+void checkpoint_invalidate(ddb_collection *collection)
+{
+  if (collection->checkpoint_on_disk)
+  {
+    remove(collection->checkpoint_file_name);
+    collection->checkpoint_on_disk = false;
+  }
+}
+
+// The first line has the totals, followed by one line per segment
+void checkpoint_write(ddb_collection *collection)
+{
+  char temp_file_name[sizeof(collection->checkpoint_file_name) + 4];
+  snprintf(temp_file_name, sizeof(temp_file_name), "%s.tmp", collection->checkpoint_file_name);
+  FILE *file = fopen(temp_file_name, "w");
+  if (!file)
+  {
+    log_message(LOG_ERROR, "Couldn't open file to write checkpoint!");
+    return;
+  }
+  fprintf(file, "{\"fileSize\":%lld,\"sequenceNumber\":%" PRIu64 ",\"liveDocuments\":%" PRIu64 ",\"deadDocuments\":%" PRIu64 ",\"liveBytes\":%" PRIu64 ",\"deadBytes\":%" PRIu64 ",\"segments\":%d}\n",
+          database_size(collection), collection->sequence_number,
+          collection->document_counts.live_documents, collection->document_counts.dead_documents,
+          collection->document_counts.live_bytes, collection->document_counts.dead_bytes, collection->num_segments);
+  for (int i = 0; i < collection->num_segments; i++)
+  {
+    fprintf(file, "{\"fileSize\":%lld,\"minId\":%" PRIu64 ",\"maxId\":%" PRIu64 ",\"liveDocuments\":%" PRIu64 "}\n",
+            get_file_size(collection->segments[i].file_name), collection->segments[i].min_id, collection->segments[i].max_id, collection->segments[i].live_documents);
+  }
+  fclose(file);
+  if (rename(temp_file_name, collection->checkpoint_file_name) == 0)
+  {
+    collection->checkpoint_on_disk = true;
+    collection->mutations_since_checkpoint = 0;
+  }
+}
+
+void checkpoint_mutation_done(ddb_collection *collection)
+{
+  if (++collection->mutations_since_checkpoint >= CHECKPOINT_INTERVAL)
+  {
+    checkpoint_write(collection);
+  }
+}
+
+// Only trusted when it lists the segments that were found, with the sizes they have now
+bool checkpoint_read(ddb_collection *collection)
+{
+  FILE *file = fopen(collection->checkpoint_file_name, "r");
+  if (!file)
+  {
+    return false;
+  }
+  long long file_size;
+  uint64_t next_sequence_number;
+  ddb_document_counts counts;
+  int checkpoint_segments;
+  int read = fscanf(file, "{\"fileSize\":%lld,\"sequenceNumber\":%" SCNu64 ",\"liveDocuments\":%" SCNu64 ",\"deadDocuments\":%" SCNu64 ",\"liveBytes\":%" SCNu64 ",\"deadBytes\":%" SCNu64 ",\"segments\":%d}\n",
+                    &file_size, &next_sequence_number,
+                    &counts.live_documents, &counts.dead_documents,
+                    &counts.live_bytes, &counts.dead_bytes, &checkpoint_segments);
+  bool valid = read == 7 && checkpoint_segments == collection->num_segments && file_size == database_size(collection);
+  ddb_segment *checkpoint_segment_states = (ddb_segment *)malloc(collection->num_segments * sizeof(ddb_segment));
+  for (int i = 0; valid && i < collection->num_segments; i++)
+  {
+    checkpoint_segment_states[i] = collection->segments[i];
+    valid = fscanf(file, "{\"fileSize\":%lld,\"minId\":%" SCNu64 ",\"maxId\":%" SCNu64 ",\"liveDocuments\":%" SCNu64 "}\n",
+                   &file_size, &checkpoint_segment_states[i].min_id, &checkpoint_segment_states[i].max_id, &checkpoint_segment_states[i].live_documents) == 4 &&
+            file_size == get_file_size(collection->segments[i].file_name);
+  }
+  fclose(file);
+  if (!valid)
+  {
+    // Written by an older run and the files have changed since, don't trust it
+    free(checkpoint_segment_states);
+    remove(collection->checkpoint_file_name);
+    return false;
+  }
+  memcpy(collection->segments, checkpoint_segment_states, collection->num_segments * sizeof(ddb_segment));
+  free(checkpoint_segment_states);
+  collection->sequence_number = next_sequence_number;
+  collection->document_counts = counts;
+  collection->checkpoint_on_disk = true;
+  collection->mutations_since_checkpoint = 0;
+  return true;
+}
+
+void reset_file(ddb_collection *collection)
+{
+  FILE *file;
+  checkpoint_invalidate(collection);
+  for (int i = collection->num_segments - 1; i > 0; i--)
+  {
+    remove(collection->segments[i].file_name);
+  }
+  file = fopen(collection->file_name, "w");
+  if (file)
+  {
+    fprintf(file, "[\n]");
+    fclose(file);
+    log_message(LOG_INFO, "Did reset!");
+  }
+  else
+  {
+    log_message(LOG_ERROR, "Couldn't open file to do reset!");
+  }
+}
+
+// A piece of a document, so that documents can be written without first being copied into one buffer
+typedef struct
+{
+  const char *bytes;
+  size_t length;
+} ddb_bytes;
+
+#define MAX_DOCUMENT_PARTS 8
+
+#ifndef _WIN32
+static bool write_all_vectors(int fd, struct iovec *vectors, int num_vectors)
+{
+  while (num_vectors > 0)
+  {
+    ssize_t written = writev(fd, vectors, num_vectors);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return false;
+    }
+    // Skip what was written, a short write can end in the middle of a vector
+    while (num_vectors > 0 && (size_t)written >= vectors->iov_len)
+    {
+      written -= vectors->iov_len;
+      vectors++;
+      num_vectors--;
+    }
+    if (num_vectors > 0)
+    {
+      vectors->iov_base = (char *)vectors->iov_base + written;
+      vectors->iov_len -= written;
+    }
+  }
+  return true;
+}
+#endif
+
+// Appends a document made of the given parts to the end of the array in the active segment, which is first rolled over
+// to a new segment when it has grown to segment_bytes. Where it was written goes in location unless that is NULL
+void add_document_parts_to_file(ddb_collection *collection, const char *_id, const ddb_bytes *parts, int num_parts, ddb_document_location *location)
+{
+  FILE *file;
+  checkpoint_invalidate(collection);
+
+  ddb_segment *segment = active_segment(collection);
+  if (segment_bytes > 0 && get_file_size(segment->file_name) >= segment_bytes)
+  {
+    segment = segment_add(collection);
+  }
+  const char *file_name = segment->file_name;
+
+  // Attempt to open the file in read+update mode, this does not truncate the file
+  file = fopen(file_name, "r+");
+  if (!file)
+  {
+    // File does not exist, create it
+    file = fopen(file_name, "w");
+    if (file)
+    {
+      fclose(file);
+    }
+    else
+    {
+      perror("Failed to create file");
+      exit(EXIT_FAILURE);
+    }
+    file = fopen(file_name, "r+");
+  }
+  if (file)
+  {
+    // File exists, find the position of the last character
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+
+    const char *prefix;
+    long position;
+    if (fileSize <= 2)
+    {
+      // File is empty or wrongly formatted; start a new JSON array
+      position = 0;
+      prefix = "[\n{\"s\":1,\"d\":";
+    }
+    else
+    {
+      // Overwrite the last two characters, which should be "\n]"
+      position = fileSize - 2;
+      // Only add the comma if there's at least one object in the file
+      prefix = position > 1 ? ",\n{\"s\":1,\"d\":" : "\n{\"s\":1,\"d\":";
+    }
+
+    size_t document_length = 0;
+    for (int i = 0; i < num_parts; i++)
+    {
+      document_length += parts[i].length;
+    }
+    size_t padding = (size_t)(document_length * padding_factor);
+    char spaces[256];
+    char *padding_spaces = padding <= sizeof(spaces) ? spaces : (char *)malloc(padding);
+    memset(padding_spaces, ' ', padding);
+    const char *suffix = "}\n]";
+
+#ifdef _WIN32
+    // No writev, so the parts are joined before writing
+    fseek(file, position, SEEK_SET);
+    fputs(prefix, file);
+    for (int i = 0; i < num_parts; i++)
+    {
+      fwrite(parts[i].bytes, 1, parts[i].length, file);
+    }
+    fwrite(padding_spaces, 1, padding, file);
+    fputs(suffix, file);
+#else
+    assert(num_parts <= MAX_DOCUMENT_PARTS);
+    struct iovec vectors[MAX_DOCUMENT_PARTS + 3];
+    int num_vectors = 0;
+    vectors[num_vectors++] = (struct iovec){(void *)prefix, strlen(prefix)};
+    for (int i = 0; i < num_parts; i++)
+    {
+      vectors[num_vectors++] = (struct iovec){(void *)parts[i].bytes, parts[i].length};
+    }
+    vectors[num_vectors++] = (struct iovec){padding_spaces, padding};
+    vectors[num_vectors++] = (struct iovec){(void *)suffix, strlen(suffix)};
+    if (lseek(fileno(file), position, SEEK_SET) < 0 || !write_all_vectors(fileno(file), vectors, num_vectors))
+    {
+      perror("Failed to write document");
+    }
+#endif
+    if (padding_spaces != spaces)
+    {
+      free(padding_spaces);
+    }
+    fclose(file);
+    segment->live_documents++;
+    segment_include_id(segment, id_sequence_number(_id));
+    collection->document_counts.live_documents++;
+    collection->document_counts.live_bytes += strlen("{\"s\":1,\"d\":}") + document_length + padding;
+    collection->write_generation++;
+    checkpoint_mutation_done(collection);
+    if (location != NULL)
+    {
+      // The container starts where the prefix leaves off {"s":1,"d":
+      snprintf(location->document_id, sizeof(location->document_id), "%s", _id);
+      location->segment = (int)(segment - collection->segments);
+      location->document_start = position + (long)strlen(prefix);
+      location->document_end = location->document_start + (long)document_length;
+      location->document_container_start = location->document_start - (long)strlen("{\"s\":1,\"d\":");
+      location->document_container_end = location->document_end + (long)padding + 1;
+      location->s_pos = location->document_container_start + (long)strlen("{\"s\":");
+    }
+  }
+}
+
+void add_document_to_file(ddb_collection *collection, const char *_id, const char *jsonString)
+{
+  ddb_bytes document = {jsonString, strlen(jsonString)};
+  add_document_parts_to_file(collection, _id, &document, 1, NULL);
+}
+
+typedef struct
+{
+  jsmn_stream_parser *parser;
+  int segment; // Index in segments of the file being parsed
+  // The stuff we want after documents are parsed
+  long document_container_start;
+  long document_container_end;
+  long document_start;
+  long document_end;
+  long s_pos;
+  int document_s;
+  char document_id[ID_LENGTH + 1];
+  // State machine for extracting the interesting stuff
+  long pos;
+  bool in_document_container;
+  bool in_document;
+  bool next_is_s;
+  bool next_is_document;
+  bool next_is_id;
+  bool document_read;
+} ddb_document_parse_state;
+
+static uint32_t hash_string(const char *string)
+{
+  uint32_t hash = 2166136261u;
+  for (const char *p = string; *p; p++)
+  {
+    hash = (hash ^ (uint8_t)*p) * 16777619u;
+  }
+  return hash;
+}
+
+static ddb_document_location *location_hint_slot(ddb_collection *collection, const char *_id)
+{
+  return &collection->location_hints[hash_string(_id) % LOCATION_HINTS];
+}
+
+void location_hint_remember(ddb_collection *collection, ddb_document_parse_state *state)
+{
+  ddb_document_location *hint = location_hint_slot(collection, state->document_id);
+  strcpy(hint->document_id, state->document_id);
+  hint->segment = state->segment;
+  hint->document_container_start = state->document_container_start;
+  hint->document_container_end = state->document_container_end;
+  hint->document_start = state->document_start;
+  hint->document_end = state->document_end;
+  hint->s_pos = state->s_pos;
+}
+
+// For a document that was just written, so that it isn't looked for in the files again
+void location_hint_store(ddb_collection *collection, const ddb_document_location *location)
+{
+  *location_hint_slot(collection, location->document_id) = *location;
+}
+
+// For a document that was rewritten in its container with another length
+void location_hint_set_document_end(ddb_collection *collection, const char *_id, long document_end)
+{
+  ddb_document_location *hint = location_hint_slot(collection, _id);
+  if (0 == strcmp(hint->document_id, _id))
+  {
+    hint->document_end = document_end;
+  }
+}
+
+void location_hint_forget(ddb_collection *collection, const char *_id)
+{
+  ddb_document_location *hint = location_hint_slot(collection, _id);
+  if (0 == strcmp(hint->document_id, _id))
+  {
+    hint->document_id[0] = '\0';
+  }
+}
+
+bool location_hint_lookup(ddb_collection *collection, const char *_id, ddb_document_location *location)
+{
+  ddb_document_location *hint = location_hint_slot(collection, _id);
+  if (_id[0] == '\0' || 0 != strcmp(hint->document_id, _id))
+  {
+    return false;
+  }
+  *location = *hint;
+  return true;
+}
+
+void location_hints_clear(ddb_collection *collection)
+{
+  memset(collection->location_hints, 0, LOCATION_HINTS * sizeof(ddb_document_location));
+}
+
+void document_cache_init(ddb_collection *collection, size_t budget)
+{
+  collection->document_cache.budget = budget;
+  if (budget == 0)
+  {
+    return;
+  }
+  // Roughly one bucket per small document that fits in the budget
+  collection->document_cache.bucket_count = 64;
+  while (collection->document_cache.bucket_count < budget / 256)
+  {
+    collection->document_cache.bucket_count *= 2;
+  }
+  collection->document_cache.buckets = (ddb_cache_entry **)calloc(collection->document_cache.bucket_count, sizeof(ddb_cache_entry *));
+}
+
+static size_t document_cache_entry_size(size_t length)
+{
+  return sizeof(ddb_cache_entry) + length + 1;
+}
+
+static ddb_cache_entry **document_cache_find(ddb_collection *collection, const char *_id)
+{
+  ddb_cache_entry **entry = &collection->document_cache.buckets[hash_string(_id) & (collection->document_cache.bucket_count - 1)];
+  while (*entry != NULL && 0 != strcmp((*entry)->document_id, _id))
+  {
+    entry = &(*entry)->hash_next;
+  }
+  return entry;
+}
+
+static void document_cache_unlink(ddb_collection *collection, ddb_cache_entry *entry)
+{
+  if (entry->more_recent)
+  {
+    entry->more_recent->less_recent = entry->less_recent;
+  }
+  else
+  {
+    collection->document_cache.most_recent = entry->less_recent;
+  }
+  if (entry->less_recent)
+  {
+    entry->less_recent->more_recent = entry->more_recent;
+  }
+  else
+  {
+    collection->document_cache.least_recent = entry->more_recent;
+  }
+}
+
+static void document_cache_link_first(ddb_collection *collection, ddb_cache_entry *entry)
+{
+  entry->more_recent = NULL;
+  entry->less_recent = collection->document_cache.most_recent;
+  if (collection->document_cache.most_recent)
+  {
+    collection->document_cache.most_recent->more_recent = entry;
+  }
+  collection->document_cache.most_recent = entry;
+  if (collection->document_cache.least_recent == NULL)
+  {
+    collection->document_cache.least_recent = entry;
+  }
+}
+
+void document_cache_forget(ddb_collection *collection, const char *_id)
+{
+  if (collection->document_cache.budget == 0)
+  {
+    return;
+  }
+  ddb_cache_entry **slot = document_cache_find(collection, _id);
+  ddb_cache_entry *entry = *slot;
+  if (entry == NULL)
+  {
+    return;
+  }
+  *slot = entry->hash_next;
+  document_cache_unlink(collection, entry);
+  collection->document_cache.resident_bytes -= document_cache_entry_size(entry->length);
+  collection->document_cache.documents--;
+  free(entry->document);
+  free(entry);
+}
+
+void document_cache_store(ddb_collection *collection, const char *_id, const char *document, size_t length)
+{
+  if (collection->document_cache.budget == 0 || document_cache_entry_size(length) > collection->document_cache.budget)
+  {
+    return;
+  }
+  document_cache_forget(collection, _id);
+  while (collection->document_cache.resident_bytes + document_cache_entry_size(length) > collection->document_cache.budget)
+  {
+    document_cache_forget(collection, collection->document_cache.least_recent->document_id);
+    collection->document_cache.evictions++;
+  }
+  ddb_cache_entry *entry = (ddb_cache_entry *)calloc(1, sizeof(ddb_cache_entry));
+  strcpy(entry->document_id, _id);
+  entry->document = (char *)malloc(length + 1);
+  memcpy(entry->document, document, length);
+  entry->document[length] = '\0';
+  entry->length = length;
+  ddb_cache_entry **slot = document_cache_find(collection, _id);
+  *slot = entry;
+  document_cache_link_first(collection, entry);
+  collection->document_cache.resident_bytes += document_cache_entry_size(length);
+  collection->document_cache.documents++;
+}
+
+bool document_cache_lookup(ddb_collection *collection, const char *_id, struct HeapString *document)
+{
+  if (collection->document_cache.budget == 0)
+  {
+    return false;
+  }
+  ddb_cache_entry *entry = *document_cache_find(collection, _id);
+  if (entry == NULL)
+  {
+    collection->document_cache.misses++;
+    return false;
+  }
+  collection->document_cache.hits++;
+  document_cache_unlink(collection, entry);
+  document_cache_link_first(collection, entry);
+  heapStringSetToCString(document, entry->document);
+  return true;
+}
+
+void document_cache_clear(ddb_collection *collection)
+{
+  while (collection->document_cache.most_recent != NULL)
+  {
+    document_cache_forget(collection, collection->document_cache.most_recent->document_id);
+  }
+}
+
+static void query_cache_drop(ddb_collection *collection, ddb_query_cache_entry *entry)
+{
+  if (entry->key == NULL)
+  {
+    return;
+  }
+  collection->query_cache.resident_bytes -= strlen(entry->key) + entry->result_length;
+  free(entry->key);
+  free(entry->result);
+  entry->key = NULL;
+  entry->result = NULL;
+}
+
+bool query_cache_lookup(ddb_collection *collection, const char *key, struct HeapString *result)
+{
+  if (collection->query_cache.budget == 0)
+  {
+    return false;
+  }
+  ddb_query_cache_entry *entry = &collection->query_cache.entries[hash_string(key) % QUERY_CACHE_SLOTS];
+  if (entry->key != NULL && entry->generation != collection->write_generation)
+  {
+    query_cache_drop(collection, entry);
+  }
+  if (entry->key == NULL || 0 != strcmp(entry->key, key))
+  {
+    collection->query_cache.misses++;
+    return false;
+  }
+  collection->query_cache.hits++;
+  heapStringReallocIfNeeded(result, entry->result_length + 1);
+  memcpy(result->contents, entry->result, entry->result_length + 1);
+  result->length = entry->result_length;
+  return true;
+}
+
+void query_cache_store(ddb_collection *collection, const char *key, const char *result, size_t result_length)
+{
+  if (collection->query_cache.budget == 0)
+  {
+    return;
+  }
+  size_t size = strlen(key) + result_length;
+  ddb_query_cache_entry *entry = &collection->query_cache.entries[hash_string(key) % QUERY_CACHE_SLOTS];
+  query_cache_drop(collection, entry);
+  if (collection->query_cache.resident_bytes + size > collection->query_cache.budget)
+  {
+    // Make room by dropping the stale entries first
+    for (int i = 0; i < QUERY_CACHE_SLOTS; i++)
+    {
+      if (collection->query_cache.entries[i].generation != collection->write_generation)
+      {
+        query_cache_drop(collection, &collection->query_cache.entries[i]);
+      }
+    }
+    if (collection->query_cache.resident_bytes + size > collection->query_cache.budget)
+    {
+      return;
+    }
+  }
+  entry->key = strdup(key);
+  entry->result = (char *)malloc(result_length + 1);
+  memcpy(entry->result, result, result_length);
+  entry->result[result_length] = '\0';
+  entry->result_length = result_length;
+  entry->generation = collection->write_generation;
+  collection->query_cache.resident_bytes += size;
+}
+
+// For everything that moves, rewrites or deletes a document
+void forget_document(ddb_collection *collection, const char *_id)
+{
+  location_hint_forget(collection, _id);
+  document_cache_forget(collection, _id);
+}
+
+void print_document_parse_state(ddb_document_parse_state *state)
+{
+  // printf("In document container: %d\n", state->in_document_container);
+  // printf("In document: %d\n", state->in_document);
+  //  printf("Next is s: %d\n", state->next_is_s);
+  //  printf("Next is document: %d\n", state->next_is_document);
+  //  printf("Next is id: %d\n", state->next_is_id);
+  log_message(LOG_DEBUG, "Document s: %d, id: %s, start pos: %ld, end pos: %ld, container start pos: %ld, container end pos: %ld",
+              state->document_s, state->document_id, state->document_start, state->document_end, state->document_container_start, state->document_container_end);
+}
+
+void start_arr(void *user_arg)
+{
+  // ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
+  // printf("Array started.\n");
+}
+void end_arr(void *user_arg)
+{
+  // printf("Array ended\n");
+}
+void start_obj(void *user_arg)
+{
+  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
+  // print_document_parse_state(document_parse_state);
+  // printf("= Object started\n");
+  document_parse_state->in_document_container = (document_parse_state->parser->stack_height == 1);
+  if (document_parse_state->in_document_container)
+  {
+    document_parse_state->document_container_start = document_parse_state->pos;
+    document_parse_state->document_container_end = -1;
+    document_parse_state->document_start = -1;
+    document_parse_state->document_end = -1;
+    document_parse_state->s_pos = -1;
+    document_parse_state->document_s = 0;
+    document_parse_state->document_id[0] = '\0';
+  }
+  else if (document_parse_state->next_is_document)
+  {
+    document_parse_state->in_document = true;
+    document_parse_state->next_is_document = false;
+    document_parse_state->document_start = document_parse_state->pos;
+  }
+}
+void end_obj(void *user_arg)
+{
+  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
+  if (document_parse_state->in_document)
+  {
+    if (document_parse_state->parser->stack_height == 4)
+    {
+      document_parse_state->document_end = document_parse_state->pos + 1;
+      document_parse_state->in_document = false;
+    }
+  }
+  if (
+      document_parse_state->parser->stack_height == 2)
+  {
+    document_parse_state->document_container_end = document_parse_state->pos + 1;
+    document_parse_state->in_document_container = false;
+    document_parse_state->document_read = true;
+  }
+}
+
+void obj_key(const char *key, size_t key_len, void *user_arg)
+{
+  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
+  if (document_parse_state->in_document_container)
+  {
+    if (strcmp(key, "s") == 0)
+    {
       document_parse_state->next_is_s = true;
     }
-    if (strcmp(key, "d") == 0)
+    if (strcmp(key, "d") == 0)
+    {
+      document_parse_state->next_is_document = true;
+    }
+  }
+  if (document_parse_state->in_document)
+  {
+    if (strcmp(key, "_id") == 0)
+    {
+      document_parse_state->next_is_id = true;
+    }
+  }
+}
+
+void str(const char *value, size_t len, void *user_arg)
+{
+  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
+  // print_document_parse_state(document_parse_state);
+  if (document_parse_state->next_is_id)
+  {
+    if (len == 24)
+    {
+      strcpy(document_parse_state->document_id, value);
+    }
+    document_parse_state->next_is_id = false;
+  }
+}
+
+void primitive(const char *value, size_t len, void *user_arg)
+{
+  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
+  // print_document_parse_state(document_parse_state);
+  if (document_parse_state->next_is_s)
+  {
+    document_parse_state->s_pos = document_parse_state->pos - len;
+    if (sscanf(value, "%d", &document_parse_state->document_s) != 1)
+    {
+      document_parse_state->document_s = 1;
+    }
+  }
+  document_parse_state->next_is_s = false;
+}
+
+jsmn_stream_callbacks_t cbs = {
+    start_arr,
+    end_arr,
+    start_obj,
+    end_obj,
+    obj_key,
+    str,
+    primitive};
+
+// Threads for the startup scan, 0 means one per core
+static int scan_threads = 0;
+
+// Ranges smaller than this aren't worth a thread of their own
+#define SCAN_MIN_RANGE_BYTES (4 * 1024 * 1024)
+#define SCAN_MAX_THREADS 64
+#define SCAN_BLOCK_BYTES (1 << 16)
+
+// Every container is written as ",\n{\"s\":" or "[\n{\"s\":" and documents never contain a raw newline,
+// so a newline followed by {"s": can only be the start of a container
+static const char container_marker[] = "\n{\"s\":";
+#define CONTAINER_MARKER_LENGTH (sizeof(container_marker) - 1)
+
+// Returns the position of the first container that starts at or after from, or file_size if there is none
+long find_container_start(FILE *file, long from, long file_size)
+{
+  char block[SCAN_BLOCK_BYTES + CONTAINER_MARKER_LENGTH];
+  // The newline before a container starting exactly at from is at from - 1
+  long block_start = from > 0 ? from - 1 : 0;
+  size_t carried = 0;
+  fseek(file, block_start, SEEK_SET);
+  size_t length;
+  while ((length = fread(block + carried, 1, SCAN_BLOCK_BYTES, file)) > 0)
+  {
+    length += carried;
+    for (char *newline = block; (newline = (char *)memchr(newline, '\n', length - (newline - block))) != NULL; newline++)
+    {
+      size_t offset = newline - block;
+      if (offset + CONTAINER_MARKER_LENGTH > length)
+      {
+        break;
+      }
+      if (0 == memcmp(newline, container_marker, CONTAINER_MARKER_LENGTH) && block_start + (long)offset + 1 >= from)
+      {
+        return block_start + (long)offset + 1;
+      }
+    }
+    // Keep the tail in case the marker straddles two blocks
+    carried = length < CONTAINER_MARKER_LENGTH - 1 ? length : CONTAINER_MARKER_LENGTH - 1;
+    memmove(block, block + length - carried, carried);
+    block_start += (long)(length - carried);
+  }
+  return file_size;
+}
+
+static int number_of_cores()
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+#else
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? (int)cores : 1;
+#endif
+}
+
+static void thread_join(pthread_t thread)
+{
+#ifdef _WIN32
+  WaitForSingleObject(thread, INFINITE);
+  CloseHandle(thread);
+#else
+  pthread_join(thread, NULL);
+#endif
+}
+
+// A part of a segment file that can be parsed on its own
+typedef struct
+{
+  int segment;
+  long start; // Position of the first container of the range
+  long end;   // Position of the first container of the next range
+} ddb_file_range;
+
+// Cuts the segments into about num_ranges ranges in all, each at least min_bytes and within one segment.
+// Returns the number of ranges, in file order, and sets *ranges to an array the caller frees
+static int64_t split_segments(ddb_collection *collection, int num_ranges, long min_bytes, ddb_file_range **ranges)
+{
+  long long total_size = database_size(collection);
+  int64_t count = 0;
+  *ranges = NULL;
+  for (int segment = 0; segment < collection->num_segments; segment++)
+  {
+    long file_size = (long)get_file_size(collection->segments[segment].file_name);
+    FILE *file = fopen(collection->segments[segment].file_name, "r");
+    if (file == NULL)
+    {
+      continue;
+    }
+    long pieces = total_size > 0 ? (long)((double)file_size * num_ranges / total_size) : 1;
+    if (pieces > file_size / min_bytes)
+    {
+      pieces = file_size / min_bytes;
+    }
+    if (pieces < 1)
+    {
+      pieces = 1;
+    }
+    *ranges = (ddb_file_range *)realloc(*ranges, (count + pieces) * sizeof(ddb_file_range));
+    for (long i = 0; i < pieces; i++)
+    {
+      ddb_file_range *range = &(*ranges)[count + i];
+      range->segment = segment;
+      // The first range starts at the beginning of the file so that the parser sees the whole array
+      range->start = i == 0 ? 0 : find_container_start(file, file_size / pieces * i, file_size);
+      range->end = file_size;
+      if (i > 0)
+      {
+        range[-1].end = range->start;
+      }
+    }
+    count += pieces;
+    fclose(file);
+  }
+  return count;
+}
+
+// Sets up the parser to read from the start of the range, which is either the start of the file or of a container
+static void parse_range_start(jsmn_stream_parser *parser, ddb_document_parse_state *document_parse_state, const ddb_file_range *range, FILE *file)
+{
+  jsmn_stream_init(parser, &cbs, document_parse_state);
+  document_parse_state->segment = range->segment;
+  if (range->start > 0)
+  {
+    // Starting in the middle of the array, the parser has to see its opening bracket first
+    jsmn_stream_parse(parser, '[');
+  }
+  fseek(file, range->start, SEEK_SET);
+  document_parse_state->pos = range->start;
+}
+
+typedef struct
+{
+  ddb_file_range range;
+  uint64_t lowest_id;
+  uint64_t highest_id;
+  ddb_document_counts counts;
+} ddb_scan_range;
+
+typedef struct
+{
+  ddb_collection *collection;
+  ddb_scan_range *ranges;
+  int64_t num_ranges;
+  int64_t next_range; // Idle threads claim the next range with an atomic add
+} ddb_startup_scan;
+
+static void scan_range(ddb_collection *collection, ddb_scan_range *range, char *block)
+{
+  FILE *infile = fopen(collection->segments[range->range.segment].file_name, "r");
+  if (infile == NULL)
+  {
+    return;
+  }
+  jsmn_stream_parser parser;
+  ddb_document_parse_state document_parse_state = {&parser};
+  parse_range_start(&parser, &document_parse_state, &range->range, infile);
+  range->lowest_id = UINT64_MAX;
+  uint64_t new_id = 0;
+  size_t length;
+  while (document_parse_state.pos < range->range.end && (length = fread(block, 1, SCAN_BLOCK_BYTES, infile)) > 0)
+  {
+    for (size_t i = 0; i < length && document_parse_state.pos < range->range.end; i++)
+    {
+      jsmn_stream_parse(&parser, block[i]);
+      if (document_parse_state.document_read)
+      {
+        long container_length = document_parse_state.document_container_end - document_parse_state.document_container_start;
+        if (document_parse_state.document_s == 1)
+        {
+          range->counts.live_documents++;
+          range->counts.live_bytes += container_length;
+        }
+        else
+        {
+          range->counts.dead_documents++;
+          range->counts.dead_bytes += container_length;
+        }
+        if ((new_id = id_sequence_number(document_parse_state.document_id)) > 0)
+        {
+          range->highest_id = new_id > range->highest_id ? new_id : range->highest_id;
+          range->lowest_id = new_id < range->lowest_id ? new_id : range->lowest_id;
+        }
+        document_parse_state.document_read = false;
+      }
+      (document_parse_state.pos)++;
+    }
+  }
+  fclose(infile);
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 startup_scan_thread(void *scan_pointer)
+{
+  ddb_startup_scan *scan = (ddb_startup_scan *)scan_pointer;
+  char *block = (char *)malloc(SCAN_BLOCK_BYTES);
+  int64_t range;
+  while ((range = ewsAtomicAdd(&scan->next_range, 1)) < scan->num_ranges)
+  {
+    scan_range(scan->collection, &scan->ranges[range], block);
+  }
+  free(block);
+  return (THREAD_RETURN_TYPE)0;
+}
+
+// Also recounts the documents and finds the _id range of every segment, it's the only time they are counted from the files.
+// The segments are split into byte ranges that are scanned in parallel, each starting at the first container boundary
+// after its split point, and the highest ids and counts of the ranges are merged
+uint64_t read_sequence_number(ddb_collection *collection)
+{
+  memset(&collection->document_counts, 0, sizeof(collection->document_counts));
+  int num_threads = scan_threads > 0 ? scan_threads : number_of_cores();
+  if (num_threads > SCAN_MAX_THREADS)
+  {
+    num_threads = SCAN_MAX_THREADS;
+  }
+  ddb_file_range *file_ranges;
+  ddb_startup_scan scan = {collection, NULL, split_segments(collection, num_threads, SCAN_MIN_RANGE_BYTES, &file_ranges), 0};
+  scan.ranges = (ddb_scan_range *)calloc(scan.num_ranges > 0 ? scan.num_ranges : 1, sizeof(ddb_scan_range));
+  for (int64_t i = 0; i < scan.num_ranges; i++)
+  {
+    scan.ranges[i].range = file_ranges[i];
+  }
+  free(file_ranges);
+  if (num_threads > scan.num_ranges)
+  {
+    num_threads = scan.num_ranges > 0 ? (int)scan.num_ranges : 1;
+  }
+
+  pthread_t threads[SCAN_MAX_THREADS];
+  for (int i = 1; i < num_threads; i++)
+  {
+    pthread_create(&threads[i], NULL, &startup_scan_thread, &scan);
+  }
+  startup_scan_thread(&scan);
+  for (int i = 1; i < num_threads; i++)
+  {
+    thread_join(threads[i]);
+  }
+
+  for (int segment = 0; segment < collection->num_segments; segment++)
+  {
+    collection->segments[segment].min_id = UINT64_MAX;
+    collection->segments[segment].max_id = 0;
+    collection->segments[segment].live_documents = 0;
+  }
+  uint64_t highest_id = 0;
+  for (int64_t i = 0; i < scan.num_ranges; i++)
+  {
+    ddb_scan_range *range = &scan.ranges[i];
+    ddb_segment *segment = &collection->segments[range->range.segment];
+    if (range->lowest_id <= range->highest_id)
+    {
+      segment_include_id(segment, range->lowest_id);
+      segment_include_id(segment, range->highest_id);
+    }
+    segment->live_documents += range->counts.live_documents;
+    highest_id = range->highest_id > highest_id ? range->highest_id : highest_id;
+    collection->document_counts.live_documents += range->counts.live_documents;
+    collection->document_counts.dead_documents += range->counts.dead_documents;
+    collection->document_counts.live_bytes += range->counts.live_bytes;
+    collection->document_counts.dead_bytes += range->counts.dead_bytes;
+  }
+  free(scan.ranges);
+  return highest_id;
+}
+
+// Uses the checkpoint when it's still valid, otherwise scans the whole file and writes a new one
+void load_database_state(ddb_collection *collection)
+{
+  location_hints_clear(collection);
+  document_cache_clear(collection);
+  collection->write_generation++;
+  segments_discover(collection);
+  if (!checkpoint_read(collection))
+  {
+    collection->sequence_number = read_sequence_number(collection) + 1;
+    checkpoint_write(collection);
+  }
+  // A partition only hands out the sequence numbers that map to it
+  collection->sequence_number += (collection->partition_index + collection->num_partitions - (collection->sequence_number - 1) % collection->num_partitions) % collection->num_partitions;
+}
+
+static bool find_one_document_in_segment(ddb_collection *collection, int segment, const char *_id, struct HeapString *document, uint64_t *bytes_scanned, uint64_t *examined)
+{
+  jsmn_stream_parser parser;
+  ddb_document_parse_state document_parse_state = {&parser, segment};
+  FILE *infile = fopen(collection->segments[segment].file_name, "r");
+  if (infile == NULL)
+  {
+    return false;
+  }
+  jsmn_stream_init(&parser, &cbs, &document_parse_state);
+
+  int ch;
+  while ((ch = fgetc(infile)) != EOF)
+  {
+    jsmn_stream_parse(&parser, (char)ch);
+    if (document_parse_state.document_read)
+    {
+      (*examined)++;
+      if (document_parse_state.document_s == 1 && 0 == strcmp(document_parse_state.document_id, _id))
+      {
+        long length = document_parse_state.document_end - document_parse_state.document_start;
+        heapStringReallocIfNeeded(document, length + 1);
+        fseek(infile, document_parse_state.document_start, SEEK_SET);
+        size_t readBytes = fread(document->contents, 1, length, infile);
+
+        document->contents[readBytes] = '\0';
+        document->length = readBytes;
+        fclose(infile);
+        *bytes_scanned += document_parse_state.pos + 1;
+        return true;
+      }
+      document_parse_state.document_read = false;
+    }
+    (document_parse_state.pos)++;
+  }
+  fclose(infile);
+  *bytes_scanned += document_parse_state.pos;
+  return false;
+}
+
+int find_one_document(ddb_collection *collection, char *_id, struct HeapString *document)
+{
+  if (document_cache_lookup(collection, _id, document))
+  {
+    return 0;
+  }
+  uint64_t bytes_scanned = 0;
+  uint64_t examined = 0;
+  for (int segment = 0; segment < collection->num_segments; segment++)
+  {
+    if (segment_may_contain(&collection->segments[segment], _id) && find_one_document_in_segment(collection, segment, _id, document, &bytes_scanned, &examined))
+    {
+      scan_finished(bytes_scanned, examined);
+      document_cache_store(collection, _id, document->contents, document->length);
+      return 0;
+    }
+  }
+  scan_finished(bytes_scanned, examined);
+  // Not found
+  return -1;
+}
+
+// Reads a document from the file without losing the position of the scan
+static size_t read_document_at(FILE *file, long start, long end, char **buffer, size_t *capacity)
+{
+  size_t length = end - start;
+  if (length + 1 > *capacity)
+  {
+    *capacity = length + 1;
+    *buffer = (char *)realloc(*buffer, *capacity);
+  }
+  long original_pos = ftell(file);
+  fseek(file, start, SEEK_SET);
+  size_t read_bytes = fread(*buffer, 1, length, file);
+  (*buffer)[read_bytes] = '\0';
+  fseek(file, original_pos, SEEK_SET);
+  return read_bytes;
+}
+
+// Threads for find and count scans, 0 means one per core. A request can ask for fewer with the X-Parallelism header
+static int query_threads = 0;
+
+// Files are cut into a few chunks per thread, so a thread that gets chunks with few matches takes more of them
+#define QUERY_CHUNKS_PER_THREAD 4
+#define QUERY_MIN_CHUNK_BYTES (1024 * 1024)
+
+typedef struct
+{
+  ddb_file_range range;
+  struct HeapString matches; // The matching documents separated by ",\n", when collecting documents
+  uint64_t count;
+  uint64_t examined;
+  uint64_t bytes_scanned;
+} ddb_scan_chunk;
+
+typedef struct
+{
+  ddb_collection *collection;
+  const char *filter_json;
+  jsmntok_t *filter_tokens;
+  int num_filter_tokens;
+  bool collect_documents;
+  bool stop_after_first; // Set when there can only be one match
+  ddb_scan_chunk *chunks;
+  int64_t num_chunks;
+  int64_t next_chunk; // Idle threads claim the next chunk with an atomic add
+  int64_t found;      // Set when stop_after_first and a match was found, the other threads stop early
+} ddb_parallel_scan;
+
+static void scan_chunk(ddb_parallel_scan *scan, ddb_scan_chunk *chunk, FILE *infile, char *block, char **buffer, size_t *capacity)
+{
+  jsmn_stream_parser parser;
+  ddb_document_parse_state document_parse_state = {&parser};
+  parse_range_start(&parser, &document_parse_state, &chunk->range, infile);
+  size_t length;
+  while (document_parse_state.pos < chunk->range.end && (length = fread(block, 1, SCAN_BLOCK_BYTES, infile)) > 0)
+  {
+    long block_start = document_parse_state.pos;
+    for (size_t i = 0; i < length && document_parse_state.pos < chunk->range.end; i++)
+    {
+      jsmn_stream_parse(&parser, block[i]);
+      if (document_parse_state.document_read)
+      {
+        document_parse_state.document_read = false;
+        chunk->examined++;
+        if (document_parse_state.document_s != 1)
+        {
+          (document_parse_state.pos)++;
+          continue;
+        }
+        // Documents that started in an earlier block are read again from the file
+        const char *document = block + (document_parse_state.document_start - block_start);
+        size_t document_length = document_parse_state.document_end - document_parse_state.document_start;
+        if (document_parse_state.document_start < block_start)
+        {
+          document_length = read_document_at(infile, document_parse_state.document_start, document_parse_state.document_end, buffer, capacity);
+          document = *buffer;
+        }
+        if (document_matches_filter(document, (int)document_length, scan->filter_json, scan->filter_tokens, scan->num_filter_tokens, 0))
+        {
+          chunk->count++;
+          if (scan->collect_documents)
+          {
+            if (chunk->matches.length > 0)
+            {
+              heapStringAppendString(&chunk->matches, ",\n");
+            }
+            heap_string_append_bytes(&chunk->matches, document, document_length);
+          }
+          if (scan->stop_after_first)
+          {
+            ewsAtomicStoreRelease(&scan->found, 1);
+          }
+        }
+        if (scan->stop_after_first && ewsAtomicLoadAcquire(&scan->found))
+        {
+          chunk->bytes_scanned = document_parse_state.pos + 1 - chunk->range.start;
+          return;
+        }
+      }
+      (document_parse_state.pos)++;
+    }
+  }
+  chunk->bytes_scanned = document_parse_state.pos - chunk->range.start;
+}
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 parallel_scan_thread(void *scan_pointer)
+{
+  ddb_parallel_scan *scan = (ddb_parallel_scan *)scan_pointer;
+  ddb_collection *collection = scan->collection;
+  char *block = (char *)malloc(SCAN_BLOCK_BYTES);
+  char *buffer = NULL;
+  size_t capacity = 0;
+  // Kept open while the chunks are in the same segment
+  FILE *infile = NULL;
+  int infile_segment = -1;
+  int64_t chunk;
+  while ((chunk = ewsAtomicAdd(&scan->next_chunk, 1)) < scan->num_chunks && !ewsAtomicLoadAcquire(&scan->found))
+  {
+    int segment = scan->chunks[chunk].range.segment;
+    if (segment != infile_segment)
+    {
+      if (infile != NULL)
+      {
+        fclose(infile);
+      }
+      infile = fopen(collection->segments[segment].file_name, "r");
+      infile_segment = segment;
+    }
+    if (infile != NULL)
+    {
+      scan_chunk(scan, &scan->chunks[chunk], infile, block, &buffer, &capacity);
+    }
+  }
+  if (infile != NULL)
+  {
+    fclose(infile);
+  }
+  free(buffer);
+  free(block);
+  return (THREAD_RETURN_TYPE)0;
+}
+
+// Runs the filter over all segments on up to max_threads threads, the calling thread being one of them.
+// Returns the number of matches, with the matching documents appended to documents in file order when it isn't NULL
+static uint64_t parallel_scan(ddb_collection *collection, const char *filter_json, jsmntok_t *filter_tokens, int num_filter_tokens, bool stop_after_first,
+                              int max_threads, struct HeapString *documents)
+{
+  ddb_parallel_scan scan = {collection, filter_json, filter_tokens, num_filter_tokens, documents != NULL, stop_after_first};
+  int num_threads = query_threads > 0 ? query_threads : number_of_cores();
+  if (max_threads > 0 && num_threads > max_threads)
+  {
+    num_threads = max_threads;
+  }
+  if (num_threads > SCAN_MAX_THREADS)
+  {
+    num_threads = SCAN_MAX_THREADS;
+  }
+  ddb_file_range *ranges;
+  scan.num_chunks = split_segments(collection, num_threads > 1 ? num_threads * QUERY_CHUNKS_PER_THREAD : 1, QUERY_MIN_CHUNK_BYTES, &ranges);
+  if (num_threads > scan.num_chunks)
+  {
+    num_threads = scan.num_chunks > 0 ? (int)scan.num_chunks : 1;
+  }
+  scan.chunks = (ddb_scan_chunk *)calloc(scan.num_chunks > 0 ? scan.num_chunks : 1, sizeof(ddb_scan_chunk));
+  for (int64_t i = 0; i < scan.num_chunks; i++)
+  {
+    scan.chunks[i].range = ranges[i];
+    heapStringInit(&scan.chunks[i].matches);
+  }
+  free(ranges);
+
+  pthread_t threads[SCAN_MAX_THREADS];
+  for (int i = 1; i < num_threads; i++)
+  {
+    pthread_create(&threads[i], NULL, &parallel_scan_thread, &scan);
+  }
+  parallel_scan_thread(&scan);
+  for (int i = 1; i < num_threads; i++)
+  {
+    thread_join(threads[i]);
+  }
+
+  uint64_t count = 0;
+  uint64_t examined = 0;
+  uint64_t bytes_scanned = 0;
+  for (int64_t i = 0; i < scan.num_chunks; i++)
+  {
+    ddb_scan_chunk *chunk = &scan.chunks[i];
+    count += chunk->count;
+    examined += chunk->examined;
+    bytes_scanned += chunk->bytes_scanned;
+    if (documents != NULL && chunk->matches.length > 0)
+    {
+      heapStringAppendString(documents, count > chunk->count ? ",\n" : "\n");
+      heap_string_append_bytes(documents, chunk->matches.contents, chunk->matches.length);
+    }
+    heapStringFreeContents(&chunk->matches);
+  }
+  free(scan.chunks);
+  scan_finished(bytes_scanned, examined);
+  return count;
+}
+
+uint64_t count_documents(ddb_collection *collection, const char *filter_json, jsmntok_t *filter_tokens, int num_filter_tokens, int max_threads)
+{
+  if (filter_tokens[0].size == 0)
+  {
+    return collection->document_counts.live_documents;
+  }
+  // There is at most one document with a given _id, so it's enough to find it
+  int id_index = get_token_index_by_key("_id", 0, filter_json, filter_tokens, num_filter_tokens);
+  bool only_id = id_index >= 0 && filter_tokens[0].size == 1;
+  return parallel_scan(collection, filter_json, filter_tokens, num_filter_tokens, only_id, max_threads, NULL);
+}
+
+// Writes the matching documents as a JSON array, in the order they are in the file
+void find_documents(ddb_collection *collection, const char *filter_json, jsmntok_t *filter_tokens, int num_filter_tokens, int max_threads, struct HeapString *result)
+{
+  heapStringAppendString(result, "[");
+  uint64_t count = parallel_scan(collection, filter_json, filter_tokens, num_filter_tokens, false, max_threads, result);
+  heapStringAppendString(result, count > 0 ? "\n]" : "]");
+}
+
+void print_contents_between_positions(FILE *file, long start_pos, long end_pos)
+{
+  long original_pos = ftell(file);
+  fseek(file, start_pos, SEEK_SET);
+
+  char c;
+  while (ftell(file) < end_pos && (c = fgetc(file)) != EOF)
+  {
+    putchar(c);
+  }
+  putchar('\n');
+  fseek(file, original_pos, SEEK_SET);
+}
+
+void move_contents(FILE *file, long dest_start, long dest_end, long src_start, long src_end)
+{
+  /*
+  ...},   |
+  {},
+  */
+  long move_size = src_end - src_start;
+  long remaining_size = dest_end - dest_start - move_size;
+  char *buffer = (char *)malloc(move_size * sizeof(char));
+  if (buffer == NULL)
+  {
+    perror("Memory allocation failed");
+    exit(EXIT_FAILURE);
+  }
+  fseek(file, src_start, SEEK_SET);
+  fread(buffer, sizeof(char), move_size, file);
+  fseek(file, dest_start, SEEK_SET);
+  fwrite(buffer, sizeof(char), move_size - 1, file);
+  if (remaining_size < 4)
+  {
+    for (long i = 0; i < remaining_size; ++i)
+    {
+      fputc(' ', file);
+    }
+    fputc('}', file);
+  }
+  else
+  {
+    fputs("},\n{", file);
+    for (long i = 0; i < remaining_size - 4; ++i)
+    {
+      fputc(' ', file);
+    }
+    fputc('}', file);
+  }
+  free(buffer);
+}
+
+void truncate_array(FILE *file, long pos)
+{
+  // This should not be necessary, make sure to know where to truncate file when parsing
+  fseek(file, pos - 1, SEEK_SET);
+  // Search for the comma or the start of the array
+  int c;
+  long prev_pos = ftell(file);
+  while (prev_pos >= 0 && (c = fgetc(file)) != ',' && c != '[')
+  {
+    // printf("%c %ld\n", c, prev_pos);
+    fseek(file, -2, SEEK_CUR); // Move two positions backward
+    prev_pos = ftell(file);
+  }
+  // printf("%c %ld\n", c, prev_pos);
+  fseek(file, prev_pos + (c == '[' ? 1 : 0), SEEK_SET);
+  fputs("\n]", file);
+#ifdef _WIN32
+  _chsize(_fileno(file), ftell(file));
+#else
+  ftruncate(fileno(file), ftell(file));
+#endif
+}
+
+// Tombstones the document and moves the last document of the segment into the space it leaves, when it fits
+static bool delete_one_document_in_segment(ddb_collection *collection, int segment, const char *_id, uint64_t *bytes_scanned, uint64_t *examined)
+{
+  jsmn_stream_parser parser;
+  ddb_document_parse_state document_parse_state = {&parser, segment};
+  FILE *infile = fopen(collection->segments[segment].file_name, "r+");
+  if (infile == NULL)
+  {
+    return false;
+  }
+  jsmn_stream_init(&parser, &cbs, &document_parse_state);
+
+  bool document_deleted = false;
+  long erased_area_start = -1;
+  long erased_area_end = -1;
+  long last_container_start = -1;
+  long last_container_end = -1;
+  char last_container_id[ID_LENGTH + 1] = "";
+  bool erased_area_has_ended = false;
+  long documents = 0;
+  // What gets overwritten or truncated away below, to keep document_counts right
+  long deleted_container_length = 0;
+  long erased_area_containers = 0;
+  long erased_area_bytes = 0;
+  long trailing_dead_containers = 0;
+  long trailing_dead_bytes = 0;
+  int ch;
+  while ((ch = fgetc(infile)) != EOF)
+  {
+    jsmn_stream_parse(&parser, (char)ch);
+    if (document_parse_state.document_read)
+    {
+      (*examined)++;
+      print_document_parse_state(&document_parse_state);
+      // print_contents_between_positions(infile, document_parse_state.document_container_start, document_parse_state.document_container_end);
+      // Keep track of the last not deleted document in the file
+      long container_length = document_parse_state.document_container_end - document_parse_state.document_container_start;
+
+      if (document_parse_state.document_s == 1)
+      {
+        documents++;
+      }
+      if (!document_deleted)
+      {
+        if (0 != strcmp(document_parse_state.document_id, _id))
+        {
+          if (document_parse_state.document_s == 0)
+          {
+            if (erased_area_start == -1)
+            {
+              erased_area_start = document_parse_state.document_container_start;
+              erased_area_containers = 0;
+              erased_area_bytes = 0;
+            }
+            erased_area_containers++;
+            erased_area_bytes += container_length;
+          }
+          else
+          {
+            erased_area_start = -1;
+          }
+        }
+        else // The matching document found
+        {
+          if (document_parse_state.document_s == 1)
+          {
+            long original_pos = ftell(infile);
+            fseek(infile, document_parse_state.s_pos, SEEK_SET);
+            fputc('0', infile);
+            document_deleted = true;
+            documents--;
+            deleted_container_length = container_length;
+            forget_document(collection, _id);
+            fseek(infile, original_pos, SEEK_SET);
+            if (erased_area_start == -1)
+            {
+              erased_area_start = document_parse_state.document_container_start;
+              erased_area_containers = 0;
+              erased_area_bytes = 0;
+            }
+            erased_area_end = document_parse_state.document_container_end;
+            erased_area_containers++;
+            erased_area_bytes += container_length;
+          }
+        }
+      }
+      else
+      {
+        if (!erased_area_has_ended)
+        {
+          if (document_parse_state.document_s == 0)
+          {
+            erased_area_end = document_parse_state.document_container_end;
+            erased_area_containers++;
+            erased_area_bytes += container_length;
+          }
+          else
+          {
+            erased_area_has_ended = true;
+          }
+        }
+        if (document_parse_state.document_s == 1)
+        {
+          last_container_start = document_parse_state.document_container_start;
+          last_container_end = document_parse_state.document_container_end;
+          strcpy(last_container_id, document_parse_state.document_id);
+          trailing_dead_containers = 0;
+          trailing_dead_bytes = 0;
+        }
+        else
+        {
+          trailing_dead_containers++;
+          trailing_dead_bytes += container_length;
+        }
+      }
+      document_parse_state.document_read = false;
+    }
+    (document_parse_state.pos)++;
+  }
+  *bytes_scanned += document_parse_state.pos;
+  /*
+  if (erased_area_end != -1)
+  {
+    printf("Area to move the last document to: \n");
+    print_contents_between_positions(infile, erased_area_start, erased_area_end);
+  }
+  */
+
+  if (document_deleted)
+  {
+    collection->write_generation++;
+    collection->segments[segment].live_documents--;
+    collection->document_counts.live_documents--;
+    collection->document_counts.live_bytes -= deleted_container_length;
+    collection->document_counts.dead_documents++;
+    collection->document_counts.dead_bytes += deleted_container_length;
+  }
+
+  // printf("%ld %ld\n", documents, last_container_start);
+  if (last_container_start != -1)
+  {
+    /*
+    printf("Last document: \n");
+    print_contents_between_positions(infile, last_container_start, last_container_end);
+    */
+    long move_size = last_container_end - last_container_start;
+    long erased_size = erased_area_end - erased_area_start;
+    if (move_size <= erased_size)
+    {
+      move_contents(infile, erased_area_start, erased_area_end, last_container_start, last_container_end);
+      truncate_array(infile, last_container_start);
+      forget_document(collection, last_container_id);
+      // The erased area now holds the moved document, padded or followed by an empty container
+      collection->document_counts.dead_documents -= erased_area_containers + trailing_dead_containers;
+      collection->document_counts.dead_bytes -= erased_area_bytes + trailing_dead_bytes;
+      if (erased_size - move_size < 4)
+      {
+        collection->document_counts.live_bytes += erased_size - move_size;
+      }
+      else
+      {
+        collection->document_counts.dead_documents++;
+        collection->document_counts.dead_bytes += erased_size - move_size - 2;
+      }
+    }
+  }
+  else if (documents == 0)
+  {
+    // We have no documents in the file
+    truncate_array(infile, 3);
+    collection->document_counts.dead_documents = 0;
+    collection->document_counts.dead_bytes = 0;
+  }
+  fclose(infile);
+  return document_deleted;
+}
+
+int delete_one_document(ddb_collection *collection, char *_id)
+{
+  checkpoint_invalidate(collection);
+  uint64_t bytes_scanned = 0;
+  uint64_t examined = 0;
+  bool document_deleted = false;
+  for (int segment = 0; segment < collection->num_segments && !document_deleted; segment++)
+  {
+    document_deleted = segment_may_contain(&collection->segments[segment], _id) && delete_one_document_in_segment(collection, segment, _id, &bytes_scanned, &examined);
+  }
+  scan_finished(bytes_scanned, examined);
+  if (document_deleted)
+  {
+    checkpoint_mutation_done(collection);
+  }
+  return document_deleted ? 0 : -1;
+}
+
+// Moves the document to the caller, or frees it when the caller doesn't want it
+static void hand_over_document(struct HeapString *document, struct HeapString *to)
+{
+  if (to != NULL)
+  {
+    *to = *document;
+  }
+  else
+  {
+    heapStringFreeContents(document);
+  }
+}
+
+// Returns 0 and the _id of the updated document, -1 if no document matched, -2 if the update is invalid and -3 if an
+// increment overflows. The updated document is handed over in updated_document unless it is NULL
+int update_one_document(ddb_collection *collection, const char *filter_json, jsmntok_t *filter_tokens, int num_filter_tokens, int filter_index,
+                        const char *update_json, jsmntok_t *update_tokens, int num_update_tokens, int update_index, char *updated_id,
+                        struct HeapString *updated_document)
+{
+  FILE *infile = NULL;
+  char *buffer = NULL;
+  size_t capacity = 0;
+  size_t length = 0;
+  bool found = false;
+  ddb_document_location location;
+
+  // Documents updated by _id, like counters, are usually where they were the last time
+  int id_index = get_token_index_by_key("_id", filter_index, filter_json, filter_tokens, num_filter_tokens);
+  char _id[ID_LENGTH + 1] = "";
+  if (id_index >= 0 && filter_tokens[filter_index].size == 1 && filter_tokens[id_index].end - filter_tokens[id_index].start == ID_LENGTH)
+  {
+    snprintf(_id, sizeof(_id), "%.*s", ID_LENGTH, filter_json + filter_tokens[id_index].start);
+    if (location_hint_lookup(collection, _id, &location) && (infile = fopen(collection->segments[location.segment].file_name, "r+")) != NULL)
+    {
+      length = read_document_at(infile, location.document_start, location.document_end, &buffer, &capacity);
+      found = document_matches_filter(buffer, (int)length, filter_json, filter_tokens, num_filter_tokens, filter_index);
+      scan_finished(length, 1);
+      if (!found)
+      {
+        fclose(infile);
+        infile = NULL;
+      }
+    }
+  }
+
+  uint64_t bytes_scanned = 0;
+  uint64_t examined = 0;
+  for (int segment = 0; !found && segment < collection->num_segments; segment++)
+  {
+    // With only an _id in the filter, the segments that can't have it are skipped
+    if ((_id[0] != '\0' && !segment_may_contain(&collection->segments[segment], _id)) || (infile = fopen(collection->segments[segment].file_name, "r+")) == NULL)
+    {
+      continue;
+    }
+    jsmn_stream_parser parser;
+    ddb_document_parse_state document_parse_state = {&parser, segment};
+    jsmn_stream_init(&parser, &cbs, &document_parse_state);
+    int ch;
+    while (!found && (ch = fgetc(infile)) != EOF)
+    {
+      jsmn_stream_parse(&parser, (char)ch);
+      if (document_parse_state.document_read)
+      {
+        examined++;
+        if (document_parse_state.document_s == 1)
+        {
+          length = read_document_at(infile, document_parse_state.document_start, document_parse_state.document_end, &buffer, &capacity);
+          found = document_matches_filter(buffer, (int)length, filter_json, filter_tokens, num_filter_tokens, filter_index);
+        }
+        document_parse_state.document_read = false;
+      }
+      (document_parse_state.pos)++;
+    }
+    bytes_scanned += document_parse_state.pos;
+    if (found)
+    {
+      location_hint_remember(collection, &document_parse_state);
+      location_hint_lookup(collection, document_parse_state.document_id, &location);
+    }
+    else
+    {
+      fclose(infile);
+    }
+  }
+  if (bytes_scanned > 0)
+  {
+    scan_finished(bytes_scanned, examined);
+  }
+  if (!found)
+  {
+    free(buffer);
+    return -1;
+  }
+  strcpy(updated_id, location.document_id);
+
+  checkpoint_invalidate(collection);
+  struct HeapString updated;
+  heapStringInit(&updated);
+  // The closing brace of the container comes after the space the document can take
+  long document_capacity = location.document_container_end - 1 - location.document_start;
+  if (increment_in_place(infile, location.document_start, document_capacity, buffer, (int)length, update_json, update_tokens, num_update_tokens, update_index, &updated))
+  {
+    // The document didn't move, only its contents changed
+    location_hint_set_document_end(collection, location.document_id, location.document_start + (long)updated.length);
+    document_cache_store(collection, location.document_id, updated.contents, updated.length);
+    hand_over_document(&updated, updated_document);
+    collection->write_generation++;
+    free(buffer);
+    fclose(infile);
+    checkpoint_mutation_done(collection);
+    return 0;
+  }
+  updated.length = 0;
+  int applied = apply_update(buffer, (int)length, update_json, update_tokens, num_update_tokens, update_index, &updated);
+  if (applied != 0)
+  {
+    heapStringFreeContents(&updated);
+    free(buffer);
+    fclose(infile);
+    return applied == -2 ? -3 : -2;
+  }
+  free(buffer);
+  forget_document(collection, location.document_id);
+
+  long container_length = location.document_container_end - location.document_container_start;
+  long updated_container_length = strlen("{\"s\":1,\"d\":}") + updated.length;
+  if (updated_container_length <= container_length)
+  {
+    // It fits, overwrite the container and pad it with whitespace the same way move_contents does
+    fseek(infile, location.document_container_start, SEEK_SET);
+    fprintf(infile, "{\"s\":1,\"d\":%s", updated.contents);
+    for (long i = updated_container_length; i < container_length; ++i)
+    {
+      fputc(' ', infile);
+    }
+    fputc('}', infile);
+    fclose(infile);
+  }
+  else
+  {
+    // Tombstone the old container and append the updated document
+    fseek(infile, location.s_pos, SEEK_SET);
+    fputc('0', infile);
+    fclose(infile);
+    collection->segments[location.segment].live_documents--;
+    collection->document_counts.live_documents--;
+    collection->document_counts.live_bytes -= container_length;
+    collection->document_counts.dead_documents++;
+    collection->document_counts.dead_bytes += container_length;
+    // Remembered where it went, a counter that got a digit longer is updated again soon
+    ddb_bytes document = {updated.contents, updated.length};
+    ddb_document_location moved;
+    add_document_parts_to_file(collection, location.document_id, &document, 1, &moved);
+    location_hint_store(collection, &moved);
+  }
+  document_cache_store(collection, location.document_id, updated.contents, updated.length);
+  hand_over_document(&updated, updated_document);
+  collection->write_generation++;
+  checkpoint_mutation_done(collection);
+  return 0;
+}
+
+// Memory budgets of the caches of every collection, set by --cache-bytes and --query-cache-bytes
+static size_t document_cache_budget = 0;
+static size_t query_cache_budget = 0;
+
+#define MAX_COLLECTIONS 256
+#define MAX_PARTITIONS 64
+
+// Set by --partitions, every collection is split into this many partitions
+static int num_partitions = 1;
+
+// Collections are only ever added. A lookup reads the array without locking, collections_lock is only taken to add one
+static ddb_collection *collections[MAX_COLLECTIONS];
+static int64_t num_collections = 0;
+static pthread_mutex_t collections_lock;
+
+// The one used by the paths without /c/<name>, stored in default.ddb.json
+static ddb_collection *default_collection;
+
+static bool collection_name_is_valid(const char *name, size_t length)
+{
+  if (length == 0 || length > COLLECTION_NAME_LENGTH)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < length; i++)
+  {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_' && name[i] != '-')
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Sets up one partition stored in <file_prefix>.ddb.json, without reading its files
+static void partition_init(ddb_collection *partition, const char *name, const char *file_prefix, int index, int count)
+{
+  memset(partition, 0, sizeof(*partition));
+  snprintf(partition->name, sizeof(partition->name), "%s", name);
+  partition->num_partitions = count;
+  partition->partition_index = index;
+  snprintf(partition->file_name, sizeof(partition->file_name), "%s.ddb.json", file_prefix);
+  snprintf(partition->checkpoint_file_name, sizeof(partition->checkpoint_file_name), "%s.ddb.checkpoint", file_prefix);
+  pthread_mutex_init(&partition->lock, NULL);
+  partition->sequence_number = index + 1;
+  partition->location_hints = (ddb_document_location *)calloc(LOCATION_HINTS, sizeof(ddb_document_location));
+  document_cache_init(partition, document_cache_budget);
+  partition->query_cache.budget = query_cache_budget;
+}
+
+// Sets up a collection stored in <name>.ddb.json, or with --partitions in <name>.p0.ddb.json, <name>.p1.ddb.json and
+// so on, without reading its files
+void collection_init(ddb_collection *collection, const char *name)
+{
+  if (num_partitions <= 1)
+  {
+    partition_init(collection, name, name, 0, 1);
+    collection->partitions = collection;
+    return;
+  }
+  memset(collection, 0, sizeof(*collection));
+  snprintf(collection->name, sizeof(collection->name), "%s", name);
+  collection->num_partitions = num_partitions;
+  collection->partitions = (ddb_collection *)calloc(num_partitions, sizeof(ddb_collection));
+  for (int i = 0; i < num_partitions; i++)
+  {
+    char file_prefix[COLLECTION_NAME_LENGTH + 16];
+    snprintf(file_prefix, sizeof(file_prefix), "%s.p%d", name, i);
+    partition_init(&collection->partitions[i], name, file_prefix, i, num_partitions);
+  }
+}
+
+void collection_load(ddb_collection *collection)
+{
+  for (int i = 0; i < collection->num_partitions; i++)
+  {
+    ddb_collection *partition = &collection->partitions[i];
+    pthread_mutex_lock(&partition->lock);
+    load_database_state(partition);
+    pthread_mutex_unlock(&partition->lock);
+  }
+}
+
+// The partition that holds the document with this _id, if there is one
+static ddb_collection *collection_partition_of(ddb_collection *collection, const char *_id)
+{
+  uint64_t sequence = id_sequence_number(_id);
+  return &collection->partitions[sequence > 0 ? (sequence - 1) % collection->num_partitions : 0];
+}
+
+// The partitions [*first, *end) that can hold documents matching the filter object at filter_index. Only the one of
+// the _id when the filter has one, all of them otherwise
+static void filter_partitions(ddb_collection *collection, const char *json, jsmntok_t *tokens, int num_tokens, int filter_index, int *first, int *end)
+{
+  int id_index = get_token_index_by_key("_id", filter_index, json, tokens, num_tokens);
+  if (id_index >= 0 && tokens[id_index].type == JSMN_STRING && tokens[id_index].end - tokens[id_index].start == ID_LENGTH)
+  {
+    char _id[ID_LENGTH + 1];
+    snprintf(_id, sizeof(_id), "%.*s", ID_LENGTH, json + tokens[id_index].start);
+    *first = (int)(collection_partition_of(collection, _id) - collection->partitions);
+    *end = *first + 1;
+  }
+  else
+  {
+    *first = 0;
+    *end = collection->num_partitions;
+  }
+}
+
+// Inserts go to the partition of the listener that accepted the connection, so the connections of different listeners
+// write to different files. With a single listener the partitions take turns
+static ddb_collection *collection_insert_partition(ddb_collection *collection, const struct Connection *connection)
+{
+  if (collection->num_partitions == 1)
+  {
+    return collection->partitions;
+  }
+  const int *listener = (const int *)connection->server->tag;
+  int64_t index = listener != NULL ? *listener : ewsAtomicAdd(&collection->next_insert_partition, 1);
+  return &collection->partitions[index % collection->num_partitions];
+}
+
+// Returns the collection with the given name, which is loaded from its files the first time it's used. Only created when
+// create is set and it has no files yet, so reading a collection that was never written doesn't leave files behind or
+// take one of the MAX_COLLECTIONS. NULL when the name isn't valid, when it doesn't exist or when there are already
+// MAX_COLLECTIONS
+ddb_collection *collection_get(const char *name, size_t length, bool create)
+{
+  int64_t count = ewsAtomicLoadAcquire(&num_collections);
+  for (int64_t i = 0; i < count; i++)
+  {
+    if (0 == strncmp(collections[i]->name, name, length) && collections[i]->name[length] == '\0')
+    {
+      return collections[i];
+    }
+  }
+  if (!collection_name_is_valid(name, length))
+  {
+    return NULL;
+  }
+  pthread_mutex_lock(&collections_lock);
+  // Another thread may have added it while this one waited
+  ddb_collection *collection = NULL;
+  count = num_collections;
+  for (int64_t i = 0; i < count && collection == NULL; i++)
+  {
+    if (0 == strncmp(collections[i]->name, name, length) && collections[i]->name[length] == '\0')
+    {
+      collection = collections[i];
+    }
+  }
+  char collection_name[COLLECTION_NAME_LENGTH + 1];
+  snprintf(collection_name, sizeof(collection_name), "%.*s", (int)length, name);
+  if (collection == NULL && !create)
+  {
+    // Written before the server started when the first file of one of its partitions is there
+    for (int i = 0; i < num_partitions && !create; i++)
+    {
+      char file_name[COLLECTION_NAME_LENGTH + 32];
+      if (num_partitions <= 1)
+      {
+        snprintf(file_name, sizeof(file_name), "%s.ddb.json", collection_name);
+      }
+      else
+      {
+        snprintf(file_name, sizeof(file_name), "%s.p%d.ddb.json", collection_name, i);
+      }
+      create = get_file_size(file_name) >= 0;
+    }
+  }
+  if (collection == NULL && create && count < MAX_COLLECTIONS)
+  {
+    collection = (ddb_collection *)malloc(sizeof(ddb_collection));
+    collection_init(collection, collection_name);
+    collection_load(collection);
+    collections[count] = collection;
+    ewsAtomicStoreRelease(&num_collections, count + 1);
+  }
+  pthread_mutex_unlock(&collections_lock);
+  return collection;
+}
+
+// Replication. With --oplog every write is also appended to oplog.ddb.jsonl as one line of JSON, and a server started
+// with --follow <host:port> in another directory reads the lines from POST /oplog of that server and applies them to its
+// own files. A position in the oplog is a byte offset in the file. The lines are written with the lock of the partition
+// held, so the writes to a document are in the oplog in the order they were done
+#define OPLOG_FILE_NAME "oplog.ddb.jsonl"
+#define FOLLOWER_POSITION_FILE_NAME "follower.ddb.position"
+#define OPLOG_BATCH_BYTES (1024 * 1024)
+#define FOLLOW_POLL_MILLISECONDS 50
+#define FOLLOW_RETRY_MILLISECONDS 1000
+
+static bool oplog_enabled = false;
+static FILE *oplog_file;
+static pthread_mutex_t oplog_lock;
+static int64_t oplog_size = 0; // Everything before it is written and flushed
+
+// Set by --follow. Only reads are served, the writes come from the oplog of the primary
+static char follow_host[256];
+static char follow_port[16];
+static const char *follow_address = NULL;
+static int64_t follower_position = 0;
+static int64_t follower_primary_size = 0; // Of the oplog of the primary, when it was last asked
+static int64_t follower_caught_up_nanoseconds = 0;
+
+static uint64_t monotonic_nanoseconds()
+{
+#ifdef _WIN32
+  LARGE_INTEGER frequency, counter;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+  return (uint64_t)(counter.QuadPart * (1e9 / frequency.QuadPart));
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
+
+static void pause_milliseconds(int milliseconds)
+{
+#ifdef _WIN32
+  Sleep(milliseconds);
+#else
+  struct timespec pause = {milliseconds / 1000, (milliseconds % 1000) * 1000 * 1000};
+  nanosleep(&pause, NULL);
+#endif
+}
+
+void oplog_open()
+{
+  pthread_mutex_init(&oplog_lock, NULL);
+  oplog_file = fopen(OPLOG_FILE_NAME, "ab");
+  if (oplog_file == NULL)
+  {
+    perror("Failed to open " OPLOG_FILE_NAME);
+    exit(EXIT_FAILURE);
+  }
+  long long size = get_file_size(OPLOG_FILE_NAME);
+  oplog_size = size > 0 ? size : 0;
+}
+
+// Appends {"c":<collection>,"op":<op>,"filter":{"_id":<_id>},<value_key>:<value>}, without the filter when _id is NULL
+// and without the value when value_key is NULL. The value has to be compact JSON, without line breaks
+static void oplog_append(ddb_collection *collection, const char *op, const char *_id, const char *value_key, const ddb_bytes *value_parts, int num_value_parts)
+{
+  if (!oplog_enabled)
+  {
+    return;
+  }
+  struct HeapString line;
+  heapStringInit(&line);
+  heapStringAppendFormat(&line, "{\"c\":\"%s\",\"op\":\"%s\"", collection->name, op);
+  if (_id != NULL)
+  {
+    heapStringAppendFormat(&line, ",\"filter\":{\"_id\":\"%s\"}", _id);
+  }
+  if (value_key != NULL)
+  {
+    heapStringAppendFormat(&line, ",\"%s\":", value_key);
+    for (int i = 0; i < num_value_parts; i++)
+    {
+      heap_string_append_bytes(&line, value_parts[i].bytes, value_parts[i].length);
+    }
+  }
+  heapStringAppendString(&line, "}\n");
+  pthread_mutex_lock(&oplog_lock);
+  if (fwrite(line.contents, 1, line.length, oplog_file) != line.length || fflush(oplog_file) != 0)
+  {
+    perror("Failed to write to " OPLOG_FILE_NAME);
+  }
+  ewsAtomicStoreRelease(&oplog_size, oplog_size + (int64_t)line.length);
+  pthread_mutex_unlock(&oplog_lock);
+  heapStringFreeContents(&line);
+}
+
+// Empties all partitions of the collection. Their locks are all held, taken in order, so that no write falls between
+// the resets of two partitions and the reset is in the oplog in the right place
+static void collection_reset(ddb_collection *collection)
+{
+  for (int i = 0; i < collection->num_partitions; i++)
+  {
+    pthread_mutex_lock(&collection->partitions[i].lock);
+  }
+  for (int i = 0; i < collection->num_partitions; i++)
+  {
+    reset_file(&collection->partitions[i]);
+    load_database_state(&collection->partitions[i]);
+  }
+  oplog_append(collection, "reset", NULL, NULL, NULL, 0);
+  for (int i = collection->num_partitions - 1; i >= 0; i--)
+  {
+    pthread_mutex_unlock(&collection->partitions[i].lock);
+  }
+}
+
+// Appends the whole lines of the oplog from position on, up to about OPLOG_BATCH_BYTES of them, separated by commas.
+// Returns the position after the last of them
+static int64_t oplog_read(int64_t position, int64_t end, struct HeapString *entries)
+{
+  FILE *file = fopen(OPLOG_FILE_NAME, "rb");
+  if (file == NULL || fseek(file, (long)position, SEEK_SET) != 0)
+  {
+    if (file != NULL)
+    {
+      fclose(file);
+    }
+    return position;
+  }
+  // A line longer than the batch is read whole
+  int64_t read_end = position;
+  char *block = (char *)malloc(OPLOG_BATCH_BYTES);
+  int64_t last_line_end = position;
+  while (read_end < end && (last_line_end == position || read_end - position < OPLOG_BATCH_BYTES))
+  {
+    size_t wanted = end - read_end < OPLOG_BATCH_BYTES ? (size_t)(end - read_end) : OPLOG_BATCH_BYTES;
+    size_t length = fread(block, 1, wanted, file);
+    if (length == 0)
+    {
+      break;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+      if (block[i] == '\n')
+      {
+        last_line_end = read_end + i + 1;
+      }
+    }
+    size_t start = entries->length;
+    heap_string_append_bytes(entries, block, length);
+    for (size_t i = start; i < entries->length; i++)
+    {
+      entries->contents[i] = entries->contents[i] == '\n' ? ',' : entries->contents[i];
+    }
+    read_end += length;
+  }
+  free(block);
+  fclose(file);
+  // Without the partial line at the end and the comma of the last whole line
+  size_t kept = (size_t)(last_line_end - position);
+  entries->length -= (size_t)(read_end - position) - kept;
+  if (kept > 0)
+  {
+    entries->length--;
+  }
+  if (entries->contents != NULL)
+  {
+    entries->contents[entries->length] = '\0';
+  }
+  return last_line_end;
+}
+
+// Applies one line of the oplog of the primary. Replaying a line that was already applied, after the follower stopped
+// before it stored its position, leaves the documents as they were
+static void oplog_apply(const char *json, jsmntok_t *tokens, int num_tokens, int entry)
+{
+  int collection_index = get_token_index_by_key("c", entry, json, tokens, num_tokens);
+  int op_index = get_token_index_by_key("op", entry, json, tokens, num_tokens);
+  ddb_collection *collection = collection_index >= 0 ? collection_get(json + tokens[collection_index].start, tokens[collection_index].end - tokens[collection_index].start, true) : NULL;
+  if (collection == NULL || op_index < 0)
+  {
+    log_message(LOG_WARNING, "Skipping oplog entry without a valid collection and op");
+    return;
+  }
+  const char *op = json + tokens[op_index].start;
+  int op_length = tokens[op_index].end - tokens[op_index].start;
+  int filter_index = get_token_index_by_key("filter", entry, json, tokens, num_tokens);
+  int document_index = get_token_index_by_key("d", entry, json, tokens, num_tokens);
+  int update_index = get_token_index_by_key("update", entry, json, tokens, num_tokens);
+  if (op_length == 5 && 0 == strncmp(op, "reset", 5))
+  {
+    collection_reset(collection);
+    return;
+  }
+  int id_index = -1;
+  if (op_length == 6 && 0 == strncmp(op, "insert", 6) && document_index >= 0)
+  {
+    id_index = get_token_index_by_key("_id", document_index, json, tokens, num_tokens);
+  }
+  else if (filter_index >= 0)
+  {
+    id_index = get_token_index_by_key("_id", filter_index, json, tokens, num_tokens);
+  }
+  if (id_index < 0 || tokens[id_index].end - tokens[id_index].start != ID_LENGTH)
+  {
+    log_message(LOG_WARNING, "Skipping oplog entry %.*s without an _id", op_length, op);
+    return;
+  }
+  char _id[ID_LENGTH + 1];
+  snprintf(_id, sizeof(_id), "%.*s", ID_LENGTH, json + tokens[id_index].start);
+  ddb_collection *partition = collection_partition_of(collection, _id);
+  pthread_mutex_lock(&partition->lock);
+  if (op_length == 6 && 0 == strncmp(op, "insert", 6))
+  {
+    struct HeapString existing;
+    heapStringInit(&existing);
+    if (find_one_document(partition, _id, &existing) != 0)
+    {
+      ddb_bytes document = {json + tokens[document_index].start, (size_t)(tokens[document_index].end - tokens[document_index].start)};
+      add_document_parts_to_file(partition, _id, &document, 1, NULL);
+    }
+    heapStringFreeContents(&existing);
+    // So that a follower that is started as a primary continues after the ids of the primary
+    uint64_t sequence = id_sequence_number(_id);
+    if (sequence >= partition->sequence_number)
+    {
+      partition->sequence_number = sequence + partition->num_partitions;
+    }
+  }
+  else if (op_length == 6 && 0 == strncmp(op, "update", 6) && update_index >= 0)
+  {
+    char updated_id[ID_LENGTH + 1];
+    update_one_document(partition, json, tokens, num_tokens, filter_index, json, tokens, num_tokens, update_index, updated_id, NULL);
+  }
+  else if (op_length == 6 && 0 == strncmp(op, "delete", 6))
+  {
+    delete_one_document(partition, _id);
+  }
+  else
+  {
+    log_message(LOG_WARNING, "Skipping unknown oplog entry %.*s", op_length, op);
+  }
+  pthread_mutex_unlock(&partition->lock);
+}
+
+// Splits host:port, false if either part is missing or too long
+static bool split_address(const char *address, char *host, size_t host_size, char *port, size_t port_size)
+{
+  const char *colon = strrchr(address, ':');
+  if (colon == NULL || colon == address || (size_t)(colon - address) >= host_size || colon[1] == '\0' || strlen(colon + 1) >= port_size)
+  {
+    return false;
+  }
+  snprintf(host, host_size, "%.*s", (int)(colon - address), address);
+  snprintf(port, port_size, "%s", colon + 1);
+  return true;
+}
+
+// How long a shard or primary gets to answer before the request to it fails
+#define PEER_TIMEOUT_SECONDS 60
+
+// A connected socket, or -1
+static sockettype connect_to(const char *host, const char *port)
+{
+  struct addrinfo hints = {0};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo *address;
+  if (getaddrinfo(host, port, &hints, &address) != 0)
+  {
+    return -1;
+  }
+  sockettype fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+  if (fd < 0 || connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    freeaddrinfo(address);
+    return -1;
+  }
+  freeaddrinfo(address);
+  // Requests are written in one send, waiting for more to fill a packet only adds latency
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+  // A server that stopped answering would hold the thread waiting for it forever
+#ifdef _WIN32
+  DWORD timeout = PEER_TIMEOUT_SECONDS * 1000;
+#else
+  struct timeval timeout = {PEER_TIMEOUT_SECONDS, 0};
+#endif
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+  return fd;
+}
+
+// Posts {"after":<position>} to /oplog of the primary and returns the HTTP status, with the body of the response in
+// body. -1 when the primary couldn't be reached
+static int oplog_fetch(int64_t position, struct HeapString *body)
+{
+  sockettype fd = connect_to(follow_host, follow_port);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  char request[512];
+  char request_body[64];
+  int request_body_length = snprintf(request_body, sizeof(request_body), "{\"after\":%" PRId64 "}", position);
+  int request_length = snprintf(request, sizeof(request),
+                                "POST /oplog HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",
+                                follow_host, request_body_length, request_body);
+  if (send(fd, request, request_length, 0) != request_length)
+  {
+    close(fd);
+    return -1;
+  }
+  // The server closes the connection after the response
+  struct HeapString response;
+  heapStringInit(&response);
+  char buffer[65536];
+  for (;;)
+  {
+    ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+    if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (received <= 0)
+    {
+      break;
+    }
+    heap_string_append_bytes(&response, buffer, received);
+  }
+  close(fd);
+  int status = -1;
+  const char *body_start = response.contents != NULL ? strstr(response.contents, "\r\n\r\n") : NULL;
+  if (body_start != NULL && sscanf(response.contents, "HTTP/%*s %d", &status) == 1)
+  {
+    heap_string_append_bytes(body, body_start + 4, response.length - (body_start + 4 - response.contents));
+  }
+  heapStringFreeContents(&response);
+  return status;
+}
+
+static void follower_position_write(int64_t position)
+{
+  FILE *file = fopen(FOLLOWER_POSITION_FILE_NAME ".tmp", "w");
+  if (file == NULL)
+  {
+    return;
+  }
+  fprintf(file, "%" PRId64 "\n", position);
+  fclose(file);
+  remove(FOLLOWER_POSITION_FILE_NAME);
+  rename(FOLLOWER_POSITION_FILE_NAME ".tmp", FOLLOWER_POSITION_FILE_NAME);
+}
+
+// Asks the primary for the next lines of its oplog as soon as the last ones are applied, and every
+// FOLLOW_POLL_MILLISECONDS when there were none
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 follow_thread(void *unused)
+{
+  struct HeapString body;
+  heapStringInit(&body);
+  for (;;)
+  {
+    body.length = 0;
+    int64_t position = ewsAtomicLoad(&follower_position);
+    int status = oplog_fetch(position, &body);
+    jsmntok_t stack_tokens[STACK_TOKENS];
+    jsmntok_t *tokens = stack_tokens;
+    int capacity = STACK_TOKENS;
+    int num_tokens = status == 200 ? parse_json_tokens(body.contents, body.length, &tokens, &capacity) : -1;
+    int next_index = num_tokens > 0 ? get_token_index_by_key("position", 0, body.contents, tokens, num_tokens) : -1;
+    int end_index = num_tokens > 0 ? get_token_index_by_key("end", 0, body.contents, tokens, num_tokens) : -1;
+    int entries_index = num_tokens > 0 ? get_token_index_by_key("entries", 0, body.contents, tokens, num_tokens) : -1;
+    if (next_index < 0 || end_index < 0 || entries_index < 0 || tokens[entries_index].type != JSMN_ARRAY)
+    {
+      log_message(LOG_WARNING, "Could not read the oplog of %s (status %d), trying again", follow_address, status);
+      if (tokens != stack_tokens)
+      {
+        free(tokens);
+      }
+      pause_milliseconds(FOLLOW_RETRY_MILLISECONDS);
+      continue;
+    }
+    for (int i = 0, entry = entries_index + 1; i < tokens[entries_index].size; i++, entry = next_sibling_token(tokens, num_tokens, entry))
+    {
+      oplog_apply(body.contents, tokens, num_tokens, entry);
+    }
+    int64_t next = strtoll(body.contents + tokens[next_index].start, NULL, 10);
+    int64_t end = strtoll(body.contents + tokens[end_index].start, NULL, 10);
+    if (tokens != stack_tokens)
+    {
+      free(tokens);
+    }
+    if (next != position)
+    {
+      follower_position_write(next);
+    }
+    ewsAtomicStoreRelease(&follower_position, next);
+    ewsAtomicStoreRelease(&follower_primary_size, end);
+    if (next >= end)
+    {
+      ewsAtomicStoreRelease(&follower_caught_up_nanoseconds, (int64_t)monotonic_nanoseconds());
+      pause_milliseconds(FOLLOW_POLL_MILLISECONDS);
+    }
+  }
+  return (THREAD_RETURN_TYPE)0;
+}
+
+// Starts following the primary at host:port from the position stored by the last run
+bool follow_start(const char *address)
+{
+  if (!split_address(address, follow_host, sizeof(follow_host), follow_port, sizeof(follow_port)))
+  {
+    return false;
+  }
+  follow_address = address;
+  FILE *file = fopen(FOLLOWER_POSITION_FILE_NAME, "r");
+  if (file != NULL)
+  {
+    int64_t position = 0;
+    if (fscanf(file, "%" SCNd64, &position) == 1)
+    {
+      follower_position = position;
+    }
+    fclose(file);
+  }
+  follower_caught_up_nanoseconds = (int64_t)monotonic_nanoseconds();
+  callWSAStartupIfNecessary();
+  pthread_t thread;
+  pthread_create(&thread, NULL, &follow_thread, NULL);
+  return true;
+}
+
+// How far the follower is behind the primary, in bytes of oplog and in seconds since it last had applied everything
+static void follower_lag(int64_t *bytes, double *seconds)
+{
+  int64_t position = ewsAtomicLoadAcquire(&follower_position);
+  int64_t primary_size = ewsAtomicLoadAcquire(&follower_primary_size);
+  *bytes = primary_size > position ? primary_size - position : 0;
+  *seconds = *bytes > 0 ? (monotonic_nanoseconds() - (uint64_t)ewsAtomicLoadAcquire(&follower_caught_up_nanoseconds)) / 1e9 : 0.0;
+}
+
+// With --router the server keeps no documents and forwards the requests to other dumdb servers, its shards. Inserts take
+// turns over the shards, which put their number in the _id, and everything else goes to the shard of the _id or to all
+#define MAX_SHARDS 64
+#define SHARD_IDLE_CONNECTIONS 64
+
+typedef struct
+{
+  char address[280];
+  char host[256];
+  char port[16];
+  pthread_mutex_t lock;
+  sockettype idle[SHARD_IDLE_CONNECTIONS]; // Kept alive connections, the last one returned is taken first
+  int num_idle;
+} ddb_shard;
+
+static ddb_shard shards[MAX_SHARDS];
+static int num_shards = 0;
+static int64_t next_insert_shard = 0;
+
+// A request to a shard and its response. The request is kept until the response is read, so that it can be sent again
+// on a new connection when the shard had closed the kept alive one
+typedef struct
+{
+  ddb_shard *shard;
+  sockettype fd;
+  bool reused;
+  bool sent;
+  bool idempotent; // Sending it twice has the same effect as once, so it can be sent again after any failure
+  struct HeapString request;
+  int code; // -1 when the shard could not be reached
+  char status[64];
+  struct HeapString body;
+} ddb_shard_call;
+
+// Takes the comma separated host:port of the shards
+bool router_start(const char *addresses)
+{
+  for (const char *address = addresses; *address != '\0';)
+  {
+    const char *comma = strchr(address, ',');
+    size_t length = comma != NULL ? (size_t)(comma - address) : strlen(address);
+    if (num_shards == MAX_SHARDS || length >= sizeof(shards[0].address))
+    {
+      return false;
+    }
+    ddb_shard *shard = &shards[num_shards];
+    snprintf(shard->address, sizeof(shard->address), "%.*s", (int)length, address);
+    if (!split_address(shard->address, shard->host, sizeof(shard->host), shard->port, sizeof(shard->port)))
+    {
+      return false;
+    }
+    pthread_mutex_init(&shard->lock, NULL);
+    num_shards++;
+    address = comma != NULL ? comma + 1 : address + length;
+  }
+  callWSAStartupIfNecessary();
+  return num_shards > 0;
+}
+
+static sockettype shard_connection(ddb_shard *shard, bool *reused)
+{
+  sockettype fd = -1;
+  pthread_mutex_lock(&shard->lock);
+  if (shard->num_idle > 0)
+  {
+    fd = shard->idle[--shard->num_idle];
+  }
+  pthread_mutex_unlock(&shard->lock);
+  *reused = fd >= 0;
+  return *reused ? fd : connect_to(shard->host, shard->port);
+}
+
+static void shard_connection_release(ddb_shard *shard, sockettype fd)
+{
+  pthread_mutex_lock(&shard->lock);
+  if (shard->num_idle < SHARD_IDLE_CONNECTIONS)
+  {
+    shard->idle[shard->num_idle++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+static bool shard_call_send(ddb_shard_call *call)
+{
+  size_t sent = 0;
+  while (call->fd >= 0 && sent < call->request.length)
+  {
+    ssize_t result = send(call->fd, call->request.contents + sent, call->request.length - sent, 0);
+    if (result < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (result <= 0)
+    {
+      return false;
+    }
+    sent += result;
+  }
+  return call->fd >= 0;
+}
+
+// Forwards the path and body of the request. The extra headers end in \r\n
+static void shard_call_start(ddb_shard_call *call, ddb_shard *shard, const struct Request *request, const char *extra_headers, bool idempotent)
+{
+  call->shard = shard;
+  call->idempotent = idempotent;
+  call->code = -1;
+  call->status[0] = '\0';
+  heapStringInit(&call->request);
+  heapStringInit(&call->body);
+  const struct Header *parallelism_header = headerInRequest("X-Parallelism", request);
+  heapStringAppendFormat(&call->request, "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n%s%s%s%s\r\n",
+                         request->path, shard->address, request->body.length, parallelism_header != NULL ? "X-Parallelism: " : "",
+                         parallelism_header != NULL ? parallelism_header->value.contents : "", parallelism_header != NULL ? "\r\n" : "", extra_headers);
+  if (request->body.length > 0)
+  {
+    heap_string_append_bytes(&call->request, request->body.contents, request->body.length);
+  }
+  call->fd = shard_connection(shard, &call->reused);
+  call->sent = shard_call_send(call);
+}
+
+// The value of the header in the response headers, which end with an empty line
+static const char *response_header_value(const char *headers, const char *name)
+{
+  size_t name_length = strlen(name);
+  for (const char *line = strstr(headers, "\r\n"); line != NULL && line[2] != '\r'; line = strstr(line + 2, "\r\n"))
+  {
+    if (0 == strncasecmp(line + 2, name, name_length) && line[2 + name_length] == ':')
+    {
+      const char *value = line + 3 + name_length;
+      while (*value == ' ')
+      {
+        value++;
+      }
+      return value;
+    }
+  }
+  return NULL;
+}
+
+// Reads one response into the call, false when the connection was closed or timed out before all of it arrived.
+// *unanswered is set when the shard closed the connection before any of the response, as it does with idle ones
+static bool shard_call_receive(ddb_shard_call *call, bool *keep_alive, bool *unanswered)
+{
+  struct HeapString *response = &call->body;
+  response->length = 0;
+  size_t header_length = 0;
+  size_t content_length = 0;
+  char buffer[65536];
+  while (header_length == 0 || response->length < header_length + content_length)
+  {
+    ssize_t received = recv(call->fd, buffer, sizeof(buffer), 0);
+    if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (received <= 0)
+    {
+      *unanswered = response->length == 0 && (received == 0 || errno == ECONNRESET);
+      return false;
+    }
+    heap_string_append_bytes(response, buffer, received);
+    const char *headers_end;
+    if (header_length == 0 && (headers_end = strstr(response->contents, "\r\n\r\n")) != NULL)
+    {
+      header_length = headers_end + 4 - response->contents;
+      const char *length_value = response_header_value(response->contents, "Content-Length");
+      const char *connection_value = response_header_value(response->contents, "Connection");
+      if (sscanf(response->contents, "HTTP/%*s %d %63[^\r]", &call->code, call->status) < 1 || length_value == NULL)
+      {
+        return false;
+      }
+      content_length = strtoull(length_value, NULL, 10);
+      *keep_alive = connection_value == NULL || 0 != strncasecmp(connection_value, "close", 5);
+    }
+  }
+  // Nothing is sent before the response is read, so more bytes are not a response of this connection
+  *keep_alive = *keep_alive && response->length == header_length + content_length;
+  memmove(response->contents, response->contents + header_length, content_length);
+  response->length = content_length;
+  response->contents[content_length] = '\0';
+  return true;
+}
+
+// Waits for the response. The shard closes connections that have been idle for a while, so one from the pool that gets
+// closed before any response is sent the request again on a new one. After other failures the shard may have done the
+// request already, only idempotent ones are sent again then
+static void shard_call_finish(ddb_shard_call *call)
+{
+  bool keep_alive = false;
+  bool unanswered = !call->sent;
+  bool received = call->sent && shard_call_receive(call, &keep_alive, &unanswered);
+  if (!received && call->reused && (unanswered || call->idempotent))
+  {
+    close(call->fd);
+    call->fd = connect_to(call->shard->host, call->shard->port);
+    call->reused = false;
+    received = shard_call_send(call) && shard_call_receive(call, &keep_alive, &unanswered);
+  }
+  if (received && keep_alive)
+  {
+    shard_connection_release(call->shard, call->fd);
+  }
+  else if (call->fd >= 0)
+  {
+    close(call->fd);
+  }
+  call->fd = -1;
+  if (!received)
+  {
+    call->code = -1;
+    call->body.length = 0;
+    log_message(LOG_WARNING, "No response from the shard at %s", call->shard->address);
+  }
+}
+
+static void shard_call_free(ddb_shard_call *call)
+{
+  heapStringFreeContents(&call->request);
+  heapStringFreeContents(&call->body);
+}
+
+// The response of the shard becomes the response of the router
+static struct Response *shard_call_response(ddb_shard_call *call)
+{
+  if (call->code < 0)
+  {
+    return responseAllocWithFormat(502, "Bad Gateway", "application/json", "{ \"status\": 502, \"message\": \"No response from the shard at %s\" }",
+                                   call->shard->address);
+  }
+  // The response takes over the body
+  struct Response *response = responseAlloc(call->code, call->status, "application/json", 0);
+  response->body = call->body;
+  heapStringInit(&call->body);
+  return response;
+}
+
+void route_table_init();
+
+// Defined by programs that include this file to use the storage functions on their own, like bench/storage.c
+#ifndef DDB_NO_MAIN
+// With --partitions, the index of the partition that inserts for the connections of every listener is its tag
+static struct Server listeners[MAX_PARTITIONS];
+static int listener_partitions[MAX_PARTITIONS];
+static uint16_t port = 8080;
+
+static THREAD_RETURN_TYPE STDCALL_ON_WIN32 listener_thread(void *listener_pointer)
+{
+  acceptConnectionsUntilStoppedFromEverywhereIPv4((struct Server *)listener_pointer, port);
+  return (THREAD_RETURN_TYPE)0;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *router_addresses = NULL;
+  for (int i = 1; i < argc; i++)
+  {
+    if (0 == strcmp(argv[i], "--padding-factor") && i + 1 < argc)
+    {
+      padding_factor = atof(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--cache-bytes") && i + 1 < argc)
+    {
+      document_cache_budget = strtoull(argv[++i], NULL, 10);
+    }
+    else if (0 == strcmp(argv[i], "--query-cache-bytes") && i + 1 < argc)
+    {
+      query_cache_budget = strtoull(argv[++i], NULL, 10);
+    }
+    else if (0 == strcmp(argv[i], "--segment-bytes") && i + 1 < argc)
+    {
+      segment_bytes = strtoll(argv[++i], NULL, 10);
+    }
+    else if (0 == strcmp(argv[i], "--scan-threads") && i + 1 < argc)
+    {
+      scan_threads = atoi(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--query-threads") && i + 1 < argc)
+    {
+      query_threads = atoi(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--partitions") && i + 1 < argc)
+    {
+      num_partitions = atoi(argv[++i]);
+      num_partitions = num_partitions < 1 ? 1 : num_partitions > MAX_PARTITIONS ? MAX_PARTITIONS : num_partitions;
+    }
+    else if (0 == strcmp(argv[i], "--port") && i + 1 < argc)
+    {
+      port = (uint16_t)atoi(argv[++i]);
+    }
+    else if (0 == strcmp(argv[i], "--oplog"))
+    {
+      oplog_enabled = true;
+    }
+    else if (0 == strcmp(argv[i], "--follow") && i + 1 < argc)
+    {
+      follow_address = argv[++i];
+    }
+    else if (0 == strcmp(argv[i], "--router") && i + 1 < argc)
+    {
+      router_addresses = argv[++i];
+    }
+    else if (0 == strcmp(argv[i], "--log-level") && i + 1 < argc && parse_log_level(argv[i + 1], &log_level))
+    {
+      i++;
+    }
+    else
+    {
+      printf("Unknown argument: %s\n", argv[i]);
+      printf("Usage: %s [--padding-factor <fraction of document size>] [--cache-bytes <memory budget for cached documents>] [--query-cache-bytes <memory budget for cached find and count results>] [--segment-bytes <size at which a new segment file is started, 0 for one file>] [--scan-threads <threads for the startup scan, default one per core>] [--query-threads <threads for find and count scans, default one per core>] [--partitions <partitions of every collection, each with its own files and listener>] [--port <port, default 8080>] [--oplog] [--follow <host:port of a server started with --oplog>] [--router <comma separated host:port of the shards>] [--log-level error|warning|info|debug]\n", argv[0]);
+      return 1;
+    }
+  }
+  log_start();
+  pthread_mutex_init(&collections_lock, NULL);
+  route_table_init();
+  // A follower only applies the writes of its primary, so its own oplog would stay incomplete
+  if (oplog_enabled && follow_address != NULL)
+  {
+    printf("--oplog and --follow can't be used together\n");
+    return 1;
+  }
+  // The shards of a router keep the documents, and their own oplogs
+  if (router_addresses != NULL && (oplog_enabled || follow_address != NULL))
+  {
+    printf("--router can't be used with --oplog or --follow, start the shards with them\n");
+    return 1;
+  }
+  if (router_addresses != NULL && !router_start(router_addresses))
+  {
+    printf("Expected --router <host:port>[,<host:port>...] with at most %d shards, not %s\n", MAX_SHARDS, router_addresses);
+    return 1;
+  }
+  if (router_addresses == NULL)
+  {
+    default_collection = collection_get("default", strlen("default"), true);
+  }
+  if (oplog_enabled)
+  {
+    oplog_open();
+  }
+  if (follow_address != NULL && !follow_start(follow_address))
+  {
+    printf("Expected --follow <host:port>, not %s\n", follow_address);
+    return 1;
+  }
+#ifdef SO_REUSEPORT
+  int num_listeners = num_partitions;
+#else
+  int num_listeners = 1;
+#endif
+  if (num_listeners == 1)
+  {
+    return acceptConnectionsUntilStoppedFromEverywhereIPv4(NULL, port);
+  }
+  // One listener per partition on the same port, the kernel spreads the connections over them
+  for (int i = 0; i < num_listeners; i++)
+  {
+    serverInit(&listeners[i]);
+    listeners[i].reusePort = true;
+    listener_partitions[i] = i;
+    listeners[i].tag = &listener_partitions[i];
+  }
+  for (int i = 1; i < num_listeners; i++)
+  {
+    pthread_t thread;
+    pthread_create(&thread, NULL, &listener_thread, &listeners[i]);
+  }
+  return acceptConnectionsUntilStoppedFromEverywhereIPv4(&listeners[0], port);
+}
+#endif
+
+const char *corsHeaders =
+    "Access-Control-Allow-Origin: *\r\n"
+    "Access-Control-Allow-Methods: POST, OPTIONS\r\n"
+    "Access-Control-Allow-Headers: Content-Type, X-Parallelism, X-Id-Prefix\r\n";
+
+// Bodies of responses that never change are sent from where they are
+#define CONSTANT_RESPONSE(code, status, body) responseAllocConstant(code, status, "application/json", body, sizeof(body) - 1)
+#define NO_DOCUMENT_FOUND "{ \"status\": 404, \"message\": \"No document found\"}"
+
+// Rereads the database from file, useful for testing
+static struct Response *handle_test_restart(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  collection_load(collection);
+
+  return CONSTANT_RESPONSE(200, "OK", "{ \"message\": \"Database restarted\" }");
+}
+
+// Deletes the database, useful for testing
+static struct Response *handle_test_reset(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  collection_reset(collection);
+
+  return CONSTANT_RESPONSE(200, "OK", "{ \"message\": \"Database reset\" }");
+}
+
+static struct Response *handle_status(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  // Summed over the partitions, one lock at a time
+  ddb_document_counts counts = {0};
+  ddb_document_cache cache = {0};
+  size_t query_budget = 0;
+  size_t query_cache_resident_bytes = 0;
+  uint64_t query_cache_hits = 0;
+  uint64_t query_cache_misses = 0;
+  long long size = 0;
+  long long cached_bytes = 0;
+  int segment_count = 0;
+  for (int i = 0; i < collection->num_partitions; i++)
+  {
+    ddb_collection *partition = &collection->partitions[i];
+    pthread_mutex_lock(&partition->lock);
+    counts.live_documents += partition->document_counts.live_documents;
+    counts.dead_documents += partition->document_counts.dead_documents;
+    counts.live_bytes += partition->document_counts.live_bytes;
+    counts.dead_bytes += partition->document_counts.dead_bytes;
+    cache.budget += partition->document_cache.budget;
+    cache.resident_bytes += partition->document_cache.resident_bytes;
+    cache.documents += partition->document_cache.documents;
+    cache.hits += partition->document_cache.hits;
+    cache.misses += partition->document_cache.misses;
+    cache.evictions += partition->document_cache.evictions;
+    query_budget += partition->query_cache.budget;
+    query_cache_resident_bytes += partition->query_cache.resident_bytes;
+    query_cache_hits += partition->query_cache.hits;
+    query_cache_misses += partition->query_cache.misses;
+    size += database_size(partition);
+    long long partition_cached_bytes = database_cached_bytes(partition);
+    cached_bytes = cached_bytes < 0 || partition_cached_bytes < 0 ? -1 : cached_bytes + partition_cached_bytes;
+    segment_count += partition->num_segments;
+    pthread_mutex_unlock(&partition->lock);
+  }
+  struct Counters counters;
+  countersRead(&counters);
+  int64_t connections_allocated = counters.connectionsAllocated;
+  int64_t connections_reused = counters.connectionsReused;
+  int64_t connections_active = counters.activeConnections;
+  pthread_mutex_lock(&connectionPool.lock);
+  int64_t connections_pooled = connectionPool.count;
+  pthread_mutex_unlock(&connectionPool.lock);
+  uint64_t lookups = cache.hits + cache.misses;
+  ddb_process_stats process;
+  get_process_stats(&process);
+  char replication[512];
+  if (follow_address != NULL)
+  {
+    int64_t lag_bytes;
+    double lag_seconds;
+    follower_lag(&lag_bytes, &lag_seconds);
+    snprintf(replication, sizeof(replication), "{ \"role\": \"follower\", \"primary\": \"%s\", \"position\": %" PRId64 ", \"lagBytes\": %" PRId64 ", \"lagSeconds\": %.3f }",
+             follow_address, (int64_t)ewsAtomicLoadAcquire(&follower_position), lag_bytes, lag_seconds);
+  }
+  else
+  {
+    snprintf(replication, sizeof(replication), oplog_enabled ? "{ \"role\": \"primary\", \"oplogBytes\": %" PRId64 " }" : "{ \"role\": \"standalone\" }",
+             (int64_t)ewsAtomicLoadAcquire(&oplog_size));
+  }
+  struct Response *response = responseAllocWithFormat(200, "OK", "application/json",
+                                                      "{ \"status\": \"OK\", \"collection\": \"%s\", \"partitions\": %d, \"buildTime\": \"%s\", \"memory\": %lld, \"databaseSize\": %lld, \"databaseCachedBytes\": %lld, \"segments\": %d, "
+                                                      "\"process\": { \"residentBytes\": %lld, \"virtualBytes\": %lld, \"peakResidentBytes\": %lld, \"threads\": %ld, \"openFiles\": %ld, \"userCpuSeconds\": %.3f, \"systemCpuSeconds\": %.3f }, "
+                                                      "\"liveDocuments\": %" PRIu64 ", \"deadDocuments\": %" PRIu64 ", \"liveBytes\": %" PRIu64 ", \"deadBytes\": %" PRIu64 ", "
+                                                      "\"cache\": { \"budget\": %zu, \"residentBytes\": %zu, \"documents\": %" PRIu64 ", \"hits\": %" PRIu64 ", \"misses\": %" PRIu64 ", \"hitRate\": %.4f, \"evictions\": %" PRIu64 " }, "
+                                                      "\"queryCache\": { \"budget\": %zu, \"residentBytes\": %zu, \"hits\": %" PRIu64 ", \"misses\": %" PRIu64 " }, "
+                                                      "\"connections\": { \"active\": %" PRId64 ", \"allocated\": %" PRId64 ", \"reused\": %" PRId64 ", \"pooled\": %" PRId64 " }, \"replication\": %s }",
+                                                      collection->name, collection->num_partitions, __TIMESTAMP__, process.resident_bytes, size, cached_bytes, segment_count,
+                                                      process.resident_bytes, process.virtual_bytes, process.peak_resident_bytes, process.threads, process.open_files, process.user_cpu_seconds, process.system_cpu_seconds,
+                                                      counts.live_documents, counts.dead_documents, counts.live_bytes, counts.dead_bytes,
+                                                      cache.budget, cache.resident_bytes, cache.documents, cache.hits, cache.misses, lookups > 0 ? (double)cache.hits / lookups : 0.0, cache.evictions,
+                                                      query_budget, query_cache_resident_bytes, query_cache_hits, query_cache_misses,
+                                                      connections_active, connections_allocated, connections_reused, connections_pooled, replication);
+  return response;
+}
+
+static struct Response *handle_insert_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  char _id[ID_LENGTH + 1];
+  const char *body = request->body.contents;
+  jsmntok_t *object = &tokens[0];
+  pthread_mutex_lock(&collection->lock);
+  generateHexId(collection->sequence_number, _id);
+  collection->sequence_number += collection->num_partitions;
+  // A router sends the number of the shard, which replaces the leading zeros so that it can tell where the document is
+  const struct Header *prefix_header = headerInRequest("X-Id-Prefix", request);
+  uint32_t prefix = prefix_header != NULL ? (uint32_t)strtoul(prefix_header->value.contents, NULL, 16) : 0;
+  if (prefix > 0)
+  {
+    char prefix_digits[9];
+    snprintf(prefix_digits, sizeof(prefix_digits), "%08" PRIx32, prefix);
+    memcpy(_id, prefix_digits, 8);
+  }
+  // Line breaks only appear between documents in the file, so bodies with them are rewritten compactly
+  if (num_tokens > 0 && object->type == JSMN_OBJECT && NULL == memchr(body + object->start, '\n', object->end - object->start) &&
+      NULL == memchr(body + object->start, '\r', object->end - object->start))
+  {
+    // The body was already validated by jsmn, so the _id is put after its opening brace without copying it
+    char id_pair[ID_LENGTH + 16];
+    int id_pair_length = snprintf(id_pair, sizeof(id_pair), "{\"_id\":\"%s\"%s", _id, object->size > 0 ? "," : "");
+    ddb_bytes parts[] = {{id_pair, id_pair_length}, {body + object->start + 1, object->end - object->start - 1}};
+    add_document_parts_to_file(collection, _id, parts, 2, NULL);
+    oplog_append(collection, "insert", NULL, "d", parts, 2);
+    if (collection->document_cache.budget > 0)
     {
-      document_parse_state->next_is_document = true;
+      struct HeapString document_as_json;
+      heapStringInit(&document_as_json);
+      heap_string_append_bytes(&document_as_json, parts[0].bytes, parts[0].length);
+      heap_string_append_bytes(&document_as_json, parts[1].bytes, parts[1].length);
+      document_cache_store(collection, _id, document_as_json.contents, document_as_json.length);
+      heapStringFreeContents(&document_as_json);
     }
   }
-  if (document_parse_state->in_document)
+  else
   {
-    if (strcmp(key, "_id") == 0)
+    struct HeapString document_as_json;
+    heapStringInit(&document_as_json);
+    stringify(body, tokens, num_tokens, 0, &document_as_json, "_id", _id);
+    add_document_to_file(collection, _id, document_as_json.contents);
+    ddb_bytes document = {document_as_json.contents, document_as_json.length};
+    oplog_append(collection, "insert", NULL, "d", &document, 1);
+    document_cache_store(collection, _id, document_as_json.contents, document_as_json.length);
+    heapStringFreeContents(&document_as_json);
+  }
+  pthread_mutex_unlock(&collection->lock);
+
+  struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{ \"_id\": \"%s\" }", _id);
+  return response;
+}
+
+// TODO: Make handle more than just find on _id
+static struct Response *handle_find_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  int id_index = get_token_index_by_key("_id", 0, request->body.contents, tokens, num_tokens);
+  char _id[ID_LENGTH + 1];
+  snprintf(_id, sizeof(_id), "%.*s", tokens[id_index].end - tokens[id_index].start, request->body.contents + tokens[id_index].start);
+
+  struct HeapString document;
+  heapStringInit(&document);
+  ddb_collection *partition = collection_partition_of(collection, _id);
+  pthread_mutex_lock(&partition->lock);
+  int found = find_one_document(partition, _id, &document);
+  pthread_mutex_unlock(&partition->lock);
+  struct Response *response;
+  if (found == 0)
+  {
+    // The response takes over the document
+    response = responseAlloc(200, "OK", "application/json", 0);
+    response->body = document;
+  }
+  else
+  {
+    response = CONSTANT_RESPONSE(404, "Not found", NO_DOCUMENT_FOUND);
+  }
+  return response;
+}
+
+// TODO: Make handle more than just find on _id
+static struct Response *handle_delete_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  int id_index = get_token_index_by_key("_id", 0, request->body.contents, tokens, num_tokens);
+  char _id[ID_LENGTH + 1];
+  snprintf(_id, sizeof(_id), "%.*s", tokens[id_index].end - tokens[id_index].start, request->body.contents + tokens[id_index].start);
+
+  ddb_collection *partition = collection_partition_of(collection, _id);
+  pthread_mutex_lock(&partition->lock);
+  int found = delete_one_document(partition, _id);
+  if (found == 0)
+  {
+    oplog_append(partition, "delete", _id, NULL, NULL, 0);
+  }
+  pthread_mutex_unlock(&partition->lock);
+  struct Response *response;
+  if (found == 0)
+  {
+    response = CONSTANT_RESPONSE(200, "OK", "{ \"status\": 200, \"message\": \"Document deleted\"}");
+  }
+  else
+  {
+    response = CONSTANT_RESPONSE(404, "Not found", NO_DOCUMENT_FOUND);
+  }
+  return response;
+}
+
+static struct Response *handle_update_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  int filter_index = get_token_index_by_key("filter", 0, request->body.contents, tokens, num_tokens);
+  int update_index = get_token_index_by_key("update", 0, request->body.contents, tokens, num_tokens);
+  if (filter_index < 0 || update_index < 0 || tokens[filter_index].type != JSMN_OBJECT || tokens[update_index].type != JSMN_OBJECT)
+  {
+    return CONSTANT_RESPONSE(400, "Bad Request", "{ \"status\": 400, \"message\": \"Expected filter and update objects\" }");
+  }
+
+  // The first partition with a matching document updates it
+  char _id[ID_LENGTH + 1];
+  int first, end;
+  filter_partitions(collection, request->body.contents, tokens, num_tokens, filter_index, &first, &end);
+  int result = -1;
+  for (int i = first; i < end && result == -1; i++)
+  {
+    ddb_collection *partition = &collection->partitions[i];
+    pthread_mutex_lock(&partition->lock);
+    struct HeapString document;
+    heapStringInit(&document);
+    result = update_one_document(partition, request->body.contents, tokens, num_tokens, filter_index,
+                                 request->body.contents, tokens, num_tokens, update_index, _id, oplog_enabled ? &document : NULL);
+    // Followers apply the update to the document it was applied to here, with the values it left behind so that replaying
+    // it after a restart doesn't increment twice
+    if (result == 0 && oplog_enabled)
     {
-      document_parse_state->next_is_id = true;
+      struct HeapString update;
+      heapStringInit(&update);
+      if (!update_for_replay(request->body.contents, tokens, num_tokens, update_index, document.contents, (int)document.length, &update))
+      {
+        // Followers still get the update, only without protection against replaying it
+        log_message(LOG_ERROR, "Could not turn the update of %s into one that can be replayed", _id);
+        update.length = 0;
+        stringify(request->body.contents, tokens, num_tokens, update_index, &update, NULL, NULL);
+      }
+      ddb_bytes value = {update.contents, update.length};
+      oplog_append(partition, "update", _id, "update", &value, 1);
+      heapStringFreeContents(&update);
     }
+    heapStringFreeContents(&document);
+    pthread_mutex_unlock(&partition->lock);
+  }
+  struct Response *response;
+  if (result == 0)
+  {
+    response = responseAllocWithFormat(200, "OK", "application/json", "{ \"updatedId\": \"%s\" }", _id);
+  }
+  else if (result == -1)
+  {
+    response = CONSTANT_RESPONSE(404, "Not found", NO_DOCUMENT_FOUND);
+  }
+  else if (result == -3)
+  {
+    response = CONSTANT_RESPONSE(400, "Bad Request", "{ \"status\": 400, \"message\": \"$inc would overflow a 64 bit integer\" }");
+  }
+  else
+  {
+    response = CONSTANT_RESPONSE(400, "Bad Request", "{ \"status\": 400, \"message\": \"Only $set, $unset and $inc of fields other than _id are supported\" }");
   }
+  return response;
 }
 
-void str(const char *value, size_t len, void *user_arg)
+// Dashboards repeat the same queries, the results stay valid until the next write to the partition
+static void find_or_count_partition(ddb_collection *partition, const struct Request *request, const char *key, jsmntok_t *tokens, int num_tokens, bool find,
+                                    int max_threads, struct HeapString *answer)
 {
-  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
-  // print_document_parse_state(document_parse_state);
-  if (document_parse_state->next_is_id)
+  pthread_mutex_lock(&partition->lock);
+  if (!query_cache_lookup(partition, key, answer))
   {
-    if (len == 24)
+    if (find)
     {
-      strcpy(document_parse_state->document_id, value);
+      find_documents(partition, request->body.contents, tokens, num_tokens, max_threads, answer);
     }
-    document_parse_state->next_is_id = false;
+    else
+    {
+      heapStringAppendFormat(answer, "{ \"count\": %" PRIu64 " }", count_documents(partition, request->body.contents, tokens, num_tokens, max_threads));
+    }
+    query_cache_store(partition, key, answer->contents, answer->length);
   }
+  pthread_mutex_unlock(&partition->lock);
 }
 
-void primitive(const char *value, size_t len, void *user_arg)
+// Puts the answers of partitions or shards together in their order. The documents of a find answer are between "[" and "\n]",
+// each starting on a new line
+typedef struct
 {
-  ddb_document_parse_state *document_parse_state = (ddb_document_parse_state *)user_arg;
-  // print_document_parse_state(document_parse_state);
-  if (document_parse_state->next_is_s)
+  struct HeapString *result;
+  bool find;
+  uint64_t count; // Documents for count, answers with documents for find
+} ddb_answers;
+
+static void answers_start(ddb_answers *answers, struct HeapString *result, bool find)
+{
+  answers->result = result;
+  answers->find = find;
+  answers->count = 0;
+  heapStringAppendString(result, find ? "[" : "");
+}
+
+static void answers_add(ddb_answers *answers, const struct HeapString *answer)
+{
+  if (answers->find && answer->length > 2)
   {
-    document_parse_state->s_pos = document_parse_state->pos - len;
-    if (sscanf(value, "%d", &document_parse_state->document_s) != 1)
+    heapStringAppendString(answers->result, answers->count > 0 ? "," : "");
+    heap_string_append_bytes(answers->result, answer->contents + 1, answer->length - 3);
+    answers->count++;
+  }
+  else if (!answers->find && answer->length > 0 && strchr(answer->contents, ':') != NULL)
+  {
+    answers->count += strtoull(strchr(answer->contents, ':') + 1, NULL, 10);
+  }
+}
+
+static void answers_finish(ddb_answers *answers)
+{
+  if (answers->find)
+  {
+    heapStringAppendString(answers->result, answers->count > 0 ? "\n]" : "]");
+  }
+  else
+  {
+    heapStringAppendFormat(answers->result, "{ \"count\": %" PRIu64 " }", answers->count);
+  }
+}
+
+static struct Response *find_or_count(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens, bool find)
+{
+  struct HeapString key;
+  heapStringInit(&key);
+  heapStringAppendString(&key, request->pathDecoded);
+  heapStringAppendChar(&key, ' ');
+  canonicalize_json(request->body.contents, tokens, num_tokens, 0, true, &key);
+
+  // Lets a heavy query leave cores for the others, the results are the same with any number of threads
+  const struct Header *parallelism_header = headerInRequest("X-Parallelism", request);
+  int max_threads = parallelism_header != NULL ? atoi(parallelism_header->value.contents) : 0;
+
+  struct Response *response = responseAlloc(200, "OK", "application/json", 0);
+  int first, end;
+  filter_partitions(collection, request->body.contents, tokens, num_tokens, 0, &first, &end);
+  if (end - first == 1)
+  {
+    find_or_count_partition(&collection->partitions[first], request, key.contents, tokens, num_tokens, find, max_threads, &response->body);
+  }
+  else
+  {
+    // Every partition answers on its own, and the answers are put together in partition order
+    struct HeapString answer;
+    heapStringInit(&answer);
+    ddb_answers answers;
+    answers_start(&answers, &response->body, find);
+    for (int i = first; i < end; i++)
     {
-      document_parse_state->document_s = 1;
+      answer.length = 0;
+      find_or_count_partition(&collection->partitions[i], request, key.contents, tokens, num_tokens, find, max_threads, &answer);
+      answers_add(&answers, &answer);
     }
+    answers_finish(&answers);
+    heapStringFreeContents(&answer);
   }
-  document_parse_state->next_is_s = false;
+  heapStringFreeContents(&key);
+  return response;
 }
 
-jsmn_stream_callbacks_t cbs = {
-    start_arr,
-    end_arr,
-    start_obj,
-    end_obj,
-    obj_key,
-    str,
-    primitive};
+static struct Response *handle_find(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  return find_or_count(collection, request, tokens, num_tokens, true);
+}
 
-uint64_t read_sequence_number()
+static struct Response *handle_count(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
 {
-  jsmn_stream_parser parser;
-  ddb_document_parse_state document_parse_state = {&parser};
-  FILE *infile = fopen(db_file_name, "r");
-  if (infile == NULL)
+  return find_or_count(collection, request, tokens, num_tokens, false);
+}
+
+// The lines of the oplog after the position in {"after":<position>}, as {"position":<after them>,"end":<of the oplog>,
+// "entries":[...]}. Followers ask for the next ones from the position they get
+static struct Response *handle_oplog(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  if (!oplog_enabled)
   {
-    return 0;
+    return CONSTANT_RESPONSE(404, "Not found", "{ \"status\": 404, \"message\": \"The server was started without --oplog\" }");
   }
-  jsmn_stream_init(&parser, &cbs, &document_parse_state);
+  int after_index = get_token_index_by_key("after", 0, request->body.contents, tokens, num_tokens);
+  int64_t after = after_index >= 0 ? strtoll(request->body.contents + tokens[after_index].start, NULL, 10) : 0;
+  int64_t end = ewsAtomicLoadAcquire(&oplog_size);
+  if (after < 0 || after > end)
+  {
+    return CONSTANT_RESPONSE(400, "Bad Request", "{ \"status\": 400, \"message\": \"The position is not in the oplog\" }");
+  }
+  struct HeapString entries;
+  heapStringInit(&entries);
+  int64_t next = oplog_read(after, end, &entries);
+  struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{ \"position\": %" PRId64 ", \"end\": %" PRId64 ", \"entries\": [", next, end);
+  if (entries.length > 0)
+  {
+    heap_string_append_bytes(&response->body, entries.contents, entries.length);
+  }
+  heapStringAppendString(&response->body, "] }");
+  heapStringFreeContents(&entries);
+  return response;
+}
 
-  uint64_t highest_id = 0;
-  uint64_t new_id = 0;
-  int ch;
-  while ((ch = fgetc(infile)) != EOF)
+// With --router these handle the routes instead, they get no collection
+
+static struct Response *route_to_shard(ddb_shard *shard, const struct Request *request, const char *extra_headers, bool idempotent)
+{
+  ddb_shard_call call;
+  shard_call_start(&call, shard, request, extra_headers, idempotent);
+  shard_call_finish(&call);
+  struct Response *response = shard_call_response(&call);
+  shard_call_free(&call);
+  return response;
+}
+
+// Every shard gets the request before any response is read, so that they work on it at the same time. The requests sent
+// to every shard are all idempotent, they read or reset
+static void route_to_every_shard(const struct Request *request, ddb_shard_call *calls)
+{
+  for (int i = 0; i < num_shards; i++)
   {
-    jsmn_stream_parse(&parser, (char)ch);
-    if (document_parse_state.document_read)
+    shard_call_start(&calls[i], &shards[i], request, "", true);
+  }
+  for (int i = 0; i < num_shards; i++)
+  {
+    shard_call_finish(&calls[i]);
+  }
+}
+
+// The index of the first call that did not succeed, -1 when all of them did
+static int failed_shard_call(const ddb_shard_call *calls)
+{
+  for (int i = 0; i < num_shards; i++)
+  {
+    if (calls[i].code != 200)
     {
-      if (sscanf(document_parse_state.document_id, "%" SCNx64, &new_id) == 1)
-      {
-        if (new_id > highest_id)
-        {
-          highest_id = new_id;
-        }
-      }
-      document_parse_state.document_read = false;
+      return i;
     }
-    (document_parse_state.pos)++;
   }
-  fclose(infile);
-  return highest_id;
+  return -1;
 }
 
-int find_one_document(char *_id, char *buffer)
+// The shard that inserted the document with the _id at id_index, -1 for ids that were not inserted through the router
+static int shard_of_id(const char *json, jsmntok_t *tokens, int id_index)
 {
-  jsmn_stream_parser parser;
-  ddb_document_parse_state document_parse_state = {&parser};
-  FILE *infile = fopen(db_file_name, "r");
-  jsmn_stream_init(&parser, &cbs, &document_parse_state);
+  if (id_index < 0 || tokens[id_index].type != JSMN_STRING || tokens[id_index].end - tokens[id_index].start != ID_LENGTH)
+  {
+    return -1;
+  }
+  char prefix[9];
+  snprintf(prefix, sizeof(prefix), "%.8s", json + tokens[id_index].start);
+  char *prefix_end;
+  unsigned long shard = strtoul(prefix, &prefix_end, 16);
+  return *prefix_end == '\0' && shard >= 1 && shard <= (unsigned long)num_shards ? (int)shard - 1 : -1;
+}
 
-  int ch;
-  while ((ch = fgetc(infile)) != EOF)
+// Goes to the shard of the _id, or to one shard after the other until one has the document
+static struct Response *route_by_id(const struct Request *request, jsmntok_t *tokens, int id_index, bool idempotent)
+{
+  int shard = shard_of_id(request->body.contents, tokens, id_index);
+  if (shard >= 0)
   {
-    jsmn_stream_parse(&parser, (char)ch);
-    if (document_parse_state.document_read)
+    return route_to_shard(&shards[shard], request, "", idempotent);
+  }
+  struct Response *response = NULL;
+  for (int i = 0; i < num_shards && (response == NULL || response->code == 404); i++)
+  {
+    if (response != NULL)
     {
-      if (document_parse_state.document_s == 1 && 0 == strcmp(document_parse_state.document_id, _id))
-      {
-        long length = document_parse_state.document_end - document_parse_state.document_start;
-        fseek(infile, document_parse_state.document_start, SEEK_SET);
-        size_t readBytes = fread(buffer, 1, length, infile);
+      responseFree(response);
+    }
+    response = route_to_shard(&shards[i], request, "", idempotent);
+  }
+  return response;
+}
+
+static struct Response *router_insert_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  int shard = (int)(ewsAtomicAdd(&next_insert_shard, 1) % num_shards);
+  char prefix_header[32];
+  snprintf(prefix_header, sizeof(prefix_header), "X-Id-Prefix: %08x\r\n", shard + 1);
+  return route_to_shard(&shards[shard], request, prefix_header, false);
+}
+
+static struct Response *router_find_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  return route_by_id(request, tokens, get_token_index_by_key("_id", 0, request->body.contents, tokens, num_tokens), true);
+}
+
+// Sent again after a failure, it could answer 404 for a document it deleted the first time
+static struct Response *router_delete_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  return route_by_id(request, tokens, get_token_index_by_key("_id", 0, request->body.contents, tokens, num_tokens), false);
+}
+
+static struct Response *router_update_one(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  int filter_index = get_token_index_by_key("filter", 0, request->body.contents, tokens, num_tokens);
+  int id_index = filter_index >= 0 ? get_token_index_by_key("_id", filter_index, request->body.contents, tokens, num_tokens) : -1;
+  return route_by_id(request, tokens, id_index, false);
+}
+
+static struct Response *router_find_or_count(const struct Request *request, bool find)
+{
+  ddb_shard_call calls[MAX_SHARDS];
+  route_to_every_shard(request, calls);
+  int failed = failed_shard_call(calls);
+  struct Response *response;
+  if (failed >= 0)
+  {
+    response = shard_call_response(&calls[failed]);
+  }
+  else
+  {
+    response = responseAlloc(200, "OK", "application/json", 0);
+    ddb_answers answers;
+    answers_start(&answers, &response->body, find);
+    for (int i = 0; i < num_shards; i++)
+    {
+      answers_add(&answers, &calls[i].body);
+    }
+    answers_finish(&answers);
+  }
+  for (int i = 0; i < num_shards; i++)
+  {
+    shard_call_free(&calls[i]);
+  }
+  return response;
+}
+
+static struct Response *router_find(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  return router_find_or_count(request, true);
+}
+
+static struct Response *router_count(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  return router_find_or_count(request, false);
+}
+
+// For /test/restart and /test/reset, the response of the first shard unless another one failed
+static struct Response *router_broadcast(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  ddb_shard_call calls[MAX_SHARDS];
+  route_to_every_shard(request, calls);
+  int failed = failed_shard_call(calls);
+  struct Response *response = shard_call_response(&calls[failed >= 0 ? failed : 0]);
+  for (int i = 0; i < num_shards; i++)
+  {
+    shard_call_free(&calls[i]);
+  }
+  return response;
+}
+
+// The status of every shard, null for the ones that did not respond with one
+static struct Response *router_status(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
+{
+  ddb_shard_call calls[MAX_SHARDS];
+  route_to_every_shard(request, calls);
+  struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{ \"status\": \"OK\", \"role\": \"router\", \"buildTime\": \"%s\", \"shards\": [",
+                                                      __TIMESTAMP__);
+  for (int i = 0; i < num_shards; i++)
+  {
+    heapStringAppendFormat(&response->body, "%s{ \"address\": \"%s\", \"status\": %s }", i > 0 ? ", " : "", shards[i].address,
+                           calls[i].code == 200 ? calls[i].body.contents : "null");
+    shard_call_free(&calls[i]);
+  }
+  heapStringAppendString(&response->body, "] }");
+  return response;
+}
+
+typedef struct Response *(*ddb_route_handler)(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens);
+
+static struct Response *handle_metrics(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens);
+
+#define ROUTE_POST 1
+#define ROUTE_GET 2 // Without a JSON body, the handler gets no tokens
+
+typedef struct
+{
+  const char *path;
+  ddb_route_handler handler;
+  unsigned methods;
+  bool insert; // Gets the partition that inserts for the connection instead of the collection, see collection_insert_partition
+  bool write;  // Refused by followers, whose documents only change through the oplog of the primary
+  ddb_route_handler routed; // Used instead of the handler with --router, the ones without are handled by the router itself
+  // The answer when the collection doesn't exist, only insertOne creates one. The handlers without one don't use the collection
+  int missing_code;
+  const char *missing_body;
+} ddb_route;
+
+static const ddb_route routes[] = {
+    {"/test/restart", handle_test_restart, ROUTE_POST, false, false, router_broadcast, 200, "{ \"message\": \"Database restarted\" }"},
+    {"/test/reset", handle_test_reset, ROUTE_POST, false, true, router_broadcast, 200, "{ \"message\": \"Database reset\" }"},
+    {"/status", handle_status, ROUTE_POST, false, false, router_status, 404, "{ \"status\": 404, \"message\": \"No such collection\" }"},
+    {"/documents/insertOne", handle_insert_one, ROUTE_POST, true, true, router_insert_one, 500,
+     "{ \"status\": 500, \"message\": \"Could not create the collection, there are too many\" }"},
+    {"/documents/findOne", handle_find_one, ROUTE_POST, false, false, router_find_one, 404, NO_DOCUMENT_FOUND},
+    {"/documents/deleteOne", handle_delete_one, ROUTE_POST, false, true, router_delete_one, 404, NO_DOCUMENT_FOUND},
+    {"/documents/updateOne", handle_update_one, ROUTE_POST, false, true, router_update_one, 404, NO_DOCUMENT_FOUND},
+    {"/documents/find", handle_find, ROUTE_POST, false, false, router_find, 200, "[]"},
+    {"/documents/count", handle_count, ROUTE_POST, false, false, router_count, 200, "{ \"count\": 0 }"},
+    {"/metrics", handle_metrics, ROUTE_GET},
+    {"/oplog", handle_oplog, ROUTE_POST},
+};
 
-        buffer[readBytes] = '\0';
-        fclose(infile);
-        return 0;
-      }
-      document_parse_state.document_read = false;
-    }
-    (document_parse_state.pos)++;
+#define NUMBER_OF_ROUTES (int)(sizeof(routes) / sizeof(routes[0]))
+#define ROUTE_SLOTS 64
+
+// route_table_init picks a seed for which every route hashes to its own slot, so a lookup is one hash and one strcmp
+static uint32_t route_hash_seed;
+static int8_t route_slots[ROUTE_SLOTS]; // Index in routes plus one, 0 for an empty slot
+
+static uint32_t route_hash(const char *path, uint32_t seed)
+{
+  uint32_t hash = 2166136261u ^ seed;
+  for (const char *p = path; *p; p++)
+  {
+    hash = (hash ^ (unsigned char)*p) * 16777619u;
   }
-  fclose(infile);
-  // Not found
-  return -1;
+  return hash;
 }
 
-void print_contents_between_positions(FILE *file, long start_pos, long end_pos)
+void route_table_init()
 {
-  long original_pos = ftell(file);
-  fseek(file, start_pos, SEEK_SET);
-
-  char c;
-  while (ftell(file) < end_pos && (c = fgetc(file)) != EOF)
+  for (uint32_t seed = 0;; seed++)
   {
-    putchar(c);
+    memset(route_slots, 0, sizeof(route_slots));
+    bool collision = false;
+    for (int i = 0; i < NUMBER_OF_ROUTES && !collision; i++)
+    {
+      int8_t *slot = &route_slots[route_hash(routes[i].path, seed) % ROUTE_SLOTS];
+      collision = *slot != 0;
+      *slot = (int8_t)(i + 1);
+    }
+    if (!collision)
+    {
+      route_hash_seed = seed;
+      return;
+    }
   }
-  putchar('\n');
-  fseek(file, original_pos, SEEK_SET);
 }
 
-void move_contents(FILE *file, long dest_start, long dest_end, long src_start, long src_end)
+static const ddb_route *route_lookup(const char *path)
 {
-  /*
-  ...},   |
-  {},
-  */
-  long move_size = src_end - src_start;
-  long remaining_size = dest_end - dest_start - move_size;
-  char *buffer = (char *)malloc(move_size * sizeof(char));
-  if (buffer == NULL)
+  int index = route_slots[route_hash(path, route_hash_seed) % ROUTE_SLOTS] - 1;
+  if (index < 0 || 0 != strcmp(routes[index].path, path))
   {
-    perror("Memory allocation failed");
-    exit(EXIT_FAILURE);
+    return NULL;
   }
-  fseek(file, src_start, SEEK_SET);
-  fread(buffer, sizeof(char), move_size, file);
-  fseek(file, dest_start, SEEK_SET);
-  fwrite(buffer, sizeof(char), move_size - 1, file);
-  if (remaining_size < 4)
+  return &routes[index];
+}
+
+#define METRIC_STATUS_CODES 7
+static const int metric_status_codes[METRIC_STATUS_CODES] = {200, 400, 403, 404, 415, 500, 502};
+
+// Per route request statistics for /metrics. Every field is a uint64_t, like in ddb_histogram
+typedef struct
+{
+  uint64_t responses[METRIC_STATUS_CODES + 1]; // By status code in metric_status_codes, the last one counts any other code
+  ddb_histogram latency;                       // In nanoseconds
+} ddb_route_metrics;
+
+// Threads record into their own stripe without locking, like the EWS counters, and /metrics sums the stripes.
+// In each stripe the last route is for paths that match no route
+static EWS_ALIGN_CACHE_LINE union ddb_route_metrics_stripe
+{
+  ddb_route_metrics routes[NUMBER_OF_ROUTES + 1];
+  char padding[(sizeof(ddb_route_metrics) * (NUMBER_OF_ROUTES + 1) + COUNTER_CACHE_LINE - 1) / COUNTER_CACHE_LINE * COUNTER_CACHE_LINE];
+} route_metrics[COUNTER_STRIPES];
+
+static void route_metrics_record(const ddb_route *route, int code, uint64_t nanoseconds)
+{
+  ddb_route_metrics *metrics = &route_metrics[counterStripeForThisThread()].routes[route != NULL ? route - routes : NUMBER_OF_ROUTES];
+  int status = 0;
+  while (status < METRIC_STATUS_CODES && metric_status_codes[status] != code)
   {
-    for (long i = 0; i < remaining_size; ++i)
-    {
-      fputc(' ', file);
-    }
-    fputc('}', file);
+    status++;
   }
-  else
+  ewsAtomicAdd(&metrics->responses[status], 1);
+  // The first bucket is for up to a microsecond
+  histogram_record(&metrics->latency, nanoseconds, 1000);
+}
+
+static void route_metrics_read(ddb_route_metrics *total)
+{
+  uint64_t *totals = (uint64_t *)total;
+  size_t fields = (NUMBER_OF_ROUTES + 1) * sizeof(ddb_route_metrics) / sizeof(uint64_t);
+  memset(total, 0, fields * sizeof(uint64_t));
+  for (int stripe = 0; stripe < COUNTER_STRIPES; stripe++)
   {
-    fputs("},\n{", file);
-    for (long i = 0; i < remaining_size - 4; ++i)
+    const uint64_t *values = (const uint64_t *)route_metrics[stripe].routes;
+    for (size_t field = 0; field < fields; field++)
     {
-      fputc(' ', file);
+      totals[field] += ewsAtomicLoad(&values[field]);
     }
-    fputc('}', file);
   }
-  free(buffer);
 }
 
-void truncate_array(FILE *file, long pos)
+// Writes the buckets as a Prometheus histogram, bucket bounds are multiplied by scale to get them in the unit of the metric
+static void append_histogram(struct HeapString *text, const char *name, const char *labels, const ddb_histogram *histogram, uint64_t unit, double scale)
 {
-  // This should not be necessary, make sure to know where to truncate file when parsing
-  fseek(file, pos - 1, SEEK_SET);
-  // Search for the comma or the start of the array
-  int c;
-  long prev_pos = ftell(file);
-  while (prev_pos >= 0 && (c = fgetc(file)) != ',' && c != '[')
+  const char *separator = labels[0] ? "," : "";
+  uint64_t cumulative = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
   {
-    // printf("%c %ld\n", c, prev_pos);
-    fseek(file, -2, SEEK_CUR); // Move two positions backward
-    prev_pos = ftell(file);
+    cumulative += histogram->buckets[bucket];
+    heapStringAppendFormat(text, "%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n", name, labels, separator, (double)(unit << bucket) * scale, cumulative);
   }
-  // printf("%c %ld\n", c, prev_pos);
-  fseek(file, prev_pos + (c == '[' ? 1 : 0), SEEK_SET);
-  fputs("\n]", file);
-#ifdef _WIN32
-  _chsize(_fileno(file), ftell(file));
-#else
-  ftruncate(fileno(file), ftell(file));
-#endif
+  heapStringAppendFormat(text, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, separator, histogram->count);
+  heapStringAppendFormat(text, labels[0] ? "%s_sum{%s} %.9g\n" : "%s_sum%s %.9g\n", name, labels, histogram->sum * scale);
+  heapStringAppendFormat(text, labels[0] ? "%s_count{%s} %" PRIu64 "\n" : "%s_count%s %" PRIu64 "\n", name, labels, histogram->count);
 }
 
-int delete_one_document(char *_id)
+// Everything is copied first, so the scrape doesn't hold a collection lock while formatting
+static struct Response *handle_metrics(ddb_collection *collection, const struct Request *request, jsmntok_t *tokens, int num_tokens)
 {
-  jsmn_stream_parser parser;
-  ddb_document_parse_state document_parse_state = {&parser};
-  FILE *infile = fopen(db_file_name, "r+");
-  jsmn_stream_init(&parser, &cbs, &document_parse_state);
+  ddb_route_metrics metrics[NUMBER_OF_ROUTES + 1];
+  ddb_scan_stats scans;
+  scan_stats_read(&scans);
+  route_metrics_read(metrics);
 
-  bool document_deleted = false;
-  long erased_area_start = -1;
-  long erased_area_end = -1;
-  long last_container_start = -1;
-  long last_container_end = -1;
-  bool erased_area_has_ended = false;
-  long documents = 0;
-  int ch;
-  while ((ch = fgetc(infile)) != EOF)
+  struct Response *response = responseAlloc(200, "OK", "text/plain; version=0.0.4", 0);
+  struct HeapString *text = &response->body;
+  heapStringAppendString(text, "# HELP ddb_responses_total Responses sent, by route and status code.\n# TYPE ddb_responses_total counter\n");
+  for (int i = 0; i <= NUMBER_OF_ROUTES; i++)
   {
-    jsmn_stream_parse(&parser, (char)ch);
-    if (document_parse_state.document_read)
+    for (int status = 0; status <= METRIC_STATUS_CODES; status++)
     {
-      printf("An object parsed\n");
-      print_document_parse_state(&document_parse_state);
-      // print_contents_between_positions(infile, document_parse_state.document_container_start, document_parse_state.document_container_end);
-      // Keep track of the last not deleted document in the file
-
-      if (document_parse_state.document_s == 1)
-      {
-        documents++;
-      }
-      if (!document_deleted)
-      {
-        if (0 != strcmp(document_parse_state.document_id, _id))
-        {
-          if (document_parse_state.document_s == 0)
-          {
-            if (erased_area_start == -1)
-            {
-              erased_area_start = document_parse_state.document_container_start;
-            }
-          }
-          else
-          {
-            erased_area_start = -1;
-          }
-        }
-        else // The matching document found
-        {
-          if (document_parse_state.document_s == 1)
-          {
-            long original_pos = ftell(infile);
-            fseek(infile, document_parse_state.s_pos, SEEK_SET);
-            fputc('0', infile);
-            document_deleted = true;
-            documents--;
-            fseek(infile, original_pos, SEEK_SET);
-            if (erased_area_start == -1)
-            {
-              erased_area_start = document_parse_state.document_container_start;
-            }
-            erased_area_end = document_parse_state.document_container_end;
-          }
-        }
-      }
-      else
+      if (metrics[i].responses[status] > 0)
       {
-        if (!erased_area_has_ended)
-        {
-          if (document_parse_state.document_s == 0)
-          {
-            erased_area_end = document_parse_state.document_container_end;
-          }
-          else
-          {
-            erased_area_has_ended = true;
-          }
-        }
-        if (document_parse_state.document_s == 1)
+        char code[8] = "other";
+        if (status < METRIC_STATUS_CODES)
         {
-          last_container_start = document_parse_state.document_container_start;
-          last_container_end = document_parse_state.document_container_end;
+          snprintf(code, sizeof(code), "%d", metric_status_codes[status]);
         }
+        heapStringAppendFormat(text, "ddb_responses_total{route=\"%s\",code=\"%s\"} %" PRIu64 "\n", i < NUMBER_OF_ROUTES ? routes[i].path : "other", code,
+                               metrics[i].responses[status]);
       }
-      document_parse_state.document_read = false;
     }
-    (document_parse_state.pos)++;
   }
-  /*
-  if (erased_area_end != -1)
+  heapStringAppendString(text, "# HELP ddb_request_duration_seconds Time from a parsed request to its response.\n# TYPE ddb_request_duration_seconds histogram\n");
+  for (int i = 0; i <= NUMBER_OF_ROUTES; i++)
   {
-    printf("Area to move the last document to: \n");
-    print_contents_between_positions(infile, erased_area_start, erased_area_end);
+    if (metrics[i].latency.count > 0)
+    {
+      char labels[64];
+      snprintf(labels, sizeof(labels), "route=\"%s\"", i < NUMBER_OF_ROUTES ? routes[i].path : "other");
+      append_histogram(text, "ddb_request_duration_seconds", labels, &metrics[i].latency, 1000, 1e-9);
+    }
   }
-  */
+  heapStringAppendFormat(text, "# HELP ddb_bytes_scanned_total Bytes of the database file read by queries.\n# TYPE ddb_bytes_scanned_total counter\nddb_bytes_scanned_total %" PRIu64 "\n",
+                         scans.bytes_scanned);
+  heapStringAppendString(text, "# HELP ddb_documents_examined Documents looked at by each query that read the file.\n# TYPE ddb_documents_examined histogram\n");
+  append_histogram(text, "ddb_documents_examined", "", &scans.documents_examined, 1, 1);
 
-  // printf("%ld %ld\n", documents, last_container_start);
-  if (last_container_start != -1)
+  // One collection at a time, so that /metrics never holds more than one lock
+  struct HeapString sizes, segment_counts, documents;
+  heapStringInit(&sizes);
+  heapStringInit(&segment_counts);
+  heapStringInit(&documents);
+  int64_t count = ewsAtomicLoadAcquire(&num_collections);
+  for (int64_t i = 0; i < count; i++)
   {
-    /*
-    printf("Last document: \n");
-    print_contents_between_positions(infile, last_container_start, last_container_end);
-    */
-    if (last_container_end - last_container_start <= erased_area_end - erased_area_start)
+    ddb_collection *listed = collections[i];
+    ddb_document_counts counts = {0};
+    long long size = 0;
+    int segment_count = 0;
+    for (int p = 0; p < listed->num_partitions; p++)
     {
-      move_contents(infile, erased_area_start, erased_area_end, last_container_start, last_container_end);
-      truncate_array(infile, last_container_start);
+      ddb_collection *partition = &listed->partitions[p];
+      pthread_mutex_lock(&partition->lock);
+      counts.live_documents += partition->document_counts.live_documents;
+      counts.dead_documents += partition->document_counts.dead_documents;
+      size += database_size(partition);
+      segment_count += partition->num_segments;
+      pthread_mutex_unlock(&partition->lock);
     }
+    heapStringAppendFormat(&sizes, "ddb_database_size_bytes{collection=\"%s\"} %lld\n", listed->name, size);
+    heapStringAppendFormat(&segment_counts, "ddb_segments{collection=\"%s\"} %d\n", listed->name, segment_count);
+    heapStringAppendFormat(&documents, "ddb_documents{collection=\"%s\",state=\"live\"} %" PRIu64 "\nddb_documents{collection=\"%s\",state=\"dead\"} %" PRIu64 "\n",
+                           listed->name, counts.live_documents, listed->name, counts.dead_documents);
   }
-  else if (documents == 0)
+  heapStringAppendFormat(text, "# HELP ddb_database_size_bytes Size of the files of the collection.\n# TYPE ddb_database_size_bytes gauge\n%s", sizes.contents);
+  heapStringAppendFormat(text, "# HELP ddb_segments Segment files the collection is split into.\n# TYPE ddb_segments gauge\n%s", segment_counts.contents);
+  heapStringAppendFormat(text, "# HELP ddb_documents Documents in the collection.\n# TYPE ddb_documents gauge\n%s", documents.contents);
+  heapStringFreeContents(&sizes);
+  heapStringFreeContents(&segment_counts);
+  heapStringFreeContents(&documents);
+  if (oplog_enabled)
   {
-    // We have no documents in the file
-    truncate_array(infile, 3);
+    heapStringAppendFormat(text, "# HELP ddb_oplog_bytes Size of the oplog that followers read.\n# TYPE ddb_oplog_bytes gauge\nddb_oplog_bytes %" PRId64 "\n",
+                           (int64_t)ewsAtomicLoadAcquire(&oplog_size));
   }
-  fclose(infile);
-  return document_deleted ? 0 : -1;
-}
-
-int main(int argc, char *argv[])
-{
-  sequence_number = read_sequence_number() + 1;
-  return acceptConnectionsUntilStoppedFromEverywhereIPv4(NULL, 8080);
+  if (follow_address != NULL)
+  {
+    int64_t lag_bytes;
+    double lag_seconds;
+    follower_lag(&lag_bytes, &lag_seconds);
+    heapStringAppendFormat(text, "# HELP ddb_replication_lag_bytes Oplog of the primary not applied yet.\n# TYPE ddb_replication_lag_bytes gauge\nddb_replication_lag_bytes %" PRId64 "\n", lag_bytes);
+    heapStringAppendFormat(text, "# HELP ddb_replication_lag_seconds Time since everything in the oplog of the primary was applied.\n# TYPE ddb_replication_lag_seconds gauge\nddb_replication_lag_seconds %.3f\n",
+                           lag_seconds);
+  }
+  responseSetStaticExtraHeaders(response, corsHeaders);
+  return response;
 }
 
-const char *corsHeaders =
-    "Access-Control-Allow-Origin: *\r\n"
-    "Access-Control-Allow-Methods: POST, OPTIONS\r\n"
-    "Access-Control-Allow-Headers: Content-Type\r\n";
-
-struct Response *createResponseForRequest(const struct Request *request, struct Connection *connection)
+// Everything below gets the request body already parsed by createResponseForRequest
+static struct Response *createResponseForJSONRequest(ddb_collection *collection, const struct Request *request, const ddb_route *route, jsmntok_t *tokens, int num_tokens)
 {
-  // To handle CORS
-  if (0 == strcmp(request->method, "OPTIONS"))
-  {
-    struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{}");
-    response->extraHeaders = strdup(corsHeaders);
-    printf("Responding to OPTIONS request: %s\n", request->pathDecoded);
-    return response;
-  }
-  // Only POST method is accepted, return 404 for everything else
-  if (0 != strcmp(request->method, "POST"))
+  if (num_tokens < 0)
   {
-    return responseAllocWithFormat(404, "Not found", "application/json", "{ \"status\" : 404 }");
+    return CONSTANT_RESPONSE(400, "Bad Request", "{ \"status\": 400, \"message\": \"Malformed JSON\" }");
   }
 
-  // Only valid Content-Type is application/json, for all calls
-  const struct Header *contentTypeHeader = headerInRequest("Content-Type", request);
-  if (contentTypeHeader != NULL && 0 != strcmp(contentTypeHeader->value.contents, "application/json"))
+  /* Assume the top-level element is an object */
+  if (num_tokens < 1 || tokens[0].type != JSMN_OBJECT)
   {
-    return responseAllocWithFormat(415, "Unsupported Media Type", "application/json", "{ \"status\": 415, \"message\": \"Only accepts content type application/json, not %s\" }", contentTypeHeader->value.contents);
+    return CONSTANT_RESPONSE(400, "Bad Request", "{ \"status\": 400, \"message\": \"Malformed JSON. Top level element must be object\" }");
   }
 
-  int num_tokens;
-  jsmn_parser parser;
-  jsmntok_t tokens[128]; /* We expect no more than 128 tokens in incoming calls so far*/
-
-  jsmn_init(&parser);
-  num_tokens = jsmn_parse(&parser, request->body.contents, request->body.length, tokens, sizeof(tokens) / sizeof(tokens[0]));
+  log_message(LOG_INFO, "POST for %s", request->pathDecoded);
 
-  if (num_tokens < 0)
+  struct Response *response;
+  if (route != NULL && collection == NULL && num_shards == 0 && route->missing_body != NULL)
   {
-    return responseAllocWithFormat(400, "Bad Request", "application/json", "{ \"status\": 400, \"message\": \"Malformed JSON\" }");
+    response = responseAllocConstant(route->missing_code, route->missing_code == 200 ? "OK" : route->missing_code == 404 ? "Not found" : "Internal Server Error",
+                                     "application/json", route->missing_body, strlen(route->missing_body));
   }
-
-  /* Assume the top-level element is an object */
-  if (num_tokens < 1 || tokens[0].type != JSMN_OBJECT)
+  else if (route != NULL)
   {
-    return responseAllocWithFormat(400, "Bad Request", "application/json", "{ \"status\": 400, \"message\": \"Malformed JSON. Top level element must be object\" }");
+    response = (num_shards > 0 && route->routed != NULL ? route->routed : route->handler)(collection, request, tokens, num_tokens);
   }
-
-  printf("POST for %s\n", request->pathDecoded);
-
-  ///////////////////
-  // /test/restart //
-  ///////////////////
-  if (0 == strcmp(request->pathDecoded, "/test/restart"))
+  else
   {
-    sequence_number = read_sequence_number() + 1;
-
-    struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{ \"message\": \"Database restarted\" }");
-    response->extraHeaders = strdup(corsHeaders);
-    return response;
+    // Unknown path
+    response = responseAlloc(404, "Not found", "application/json", 0);
+    heapStringAppendString(&response->body, "{ \"status\": 404, \"message\": \"Non-existing path: ");
+    append_escaped_json_string(&response->body, request->pathDecoded);
+    heapStringAppendString(&response->body, "\"}");
   }
+  responseSetStaticExtraHeaders(response, corsHeaders);
+  return response;
+}
 
-  /////////////////
-  // /test/reset //
-  /////////////////
-  if (0 == strcmp(request->pathDecoded, "/test/reset"))
+static struct Response *createResponseForRoute(ddb_collection *collection, const struct Request *request, const ddb_route *route)
+{
+  // To handle CORS
+  if (0 == strcmp(request->method, "OPTIONS"))
   {
-    reset_file();
-    sequence_number = read_sequence_number() + 1;
-
-    struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{ \"message\": \"Database reset\" }");
-    response->extraHeaders = strdup(corsHeaders);
+    struct Response *response = CONSTANT_RESPONSE(200, "OK", "{}");
+    responseSetStaticExtraHeaders(response, corsHeaders);
+    log_message(LOG_INFO, "Responding to OPTIONS request: %s", request->pathDecoded);
     return response;
   }
-  /////////////
-  // /status //
-  /////////////
-  if (0 == strcmp(request->pathDecoded, "/status"))
+  // Only the methods of the route are accepted, return 404 for everything else. Unknown paths only take POST
+  unsigned method = 0 == strcmp(request->method, "POST") ? ROUTE_POST : 0 == strcmp(request->method, "GET") ? ROUTE_GET : 0;
+  if (!(method & (route != NULL ? route->methods : ROUTE_POST)))
   {
-    struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{ \"status\": \"OK\", \"buildTime\": \"%s\", \"memory\": %ld, \"databaseSize\": %lld }", __TIMESTAMP__, get_process_memory_usage(), get_file_size(db_file_name));
-    response->extraHeaders = strdup(corsHeaders);
-    return response;
+    return CONSTANT_RESPONSE(404, "Not found", "{ \"status\" : 404 }");
   }
-
-  //////////////////////////
-  // /documents/insertOne //
-  //////////////////////////
-  if (0 == strcmp(request->pathDecoded, "/documents/insertOne"))
+  if (method == ROUTE_GET)
   {
-    char _id[ID_LENGTH + 1];
-    generateHexId(sequence_number++, _id);
-    // TODO: Make a streaming version of stringify to avoid the static alloc
-    char document_as_json[10240];
-    int pos = 0;
-    stringify(request->body.contents, tokens, num_tokens, 0, document_as_json, &pos, "_id", _id);
-    printf("%s\n", document_as_json);
-    add_document_to_file(document_as_json);
-
-    struct Response *response = responseAllocWithFormat(200, "OK", "application/json", "{ \"_id\": \"%s\" }", _id);
-    response->extraHeaders = strdup(corsHeaders);
-    return response;
+    return route->handler(collection, request, NULL, 0);
   }
-
-  ////////////////////////
-  // /documents/findOne //
-  ////////////////////////
-  // TODO: Make handle more than just find on _id
-  if (0 == strcmp(request->pathDecoded, "/documents/findOne"))
+  if (route != NULL && route->write && follow_address != NULL)
   {
-    int id_index = get_token_index_by_key("_id", 0, request->body.contents, tokens, num_tokens);
-    char _id[ID_LENGTH + 1];
-    snprintf(_id, sizeof(_id), "%.*s", tokens[id_index].end - tokens[id_index].start, request->body.contents + tokens[id_index].start);
-
-    char buffer[1024];
-    int found = find_one_document(_id, buffer);
-    struct Response *response;
-    if (found == 0)
-    {
-      response = responseAllocWithFormat(200, "OK", "application/json", "%s", buffer);
-    }
-    else
-    {
-      response = responseAllocWithFormat(404, "Not found", "application/json", "{ \"status\": 404, \"message\": \"No document found\"}");
-    }
-    response->extraHeaders = strdup(corsHeaders);
+    struct Response *response = CONSTANT_RESPONSE(403, "Forbidden", "{ \"status\": 403, \"message\": \"This server follows another one, send writes there\" }");
+    responseSetStaticExtraHeaders(response, corsHeaders);
     return response;
   }
 
-  //////////////////////////
-  // /documents/deleteOne //
-  //////////////////////////
-  // TODO: Make handle more than just find on _id
-  if (0 == strcmp(request->pathDecoded, "/documents/deleteOne"))
+  // Only valid Content-Type is application/json, for all calls
+  const struct Header *contentTypeHeader = headerInRequest("Content-Type", request);
+  if (contentTypeHeader != NULL && 0 != strcmp(contentTypeHeader->value.contents, "application/json"))
   {
-    int id_index = get_token_index_by_key("_id", 0, request->body.contents, tokens, num_tokens);
-    char _id[ID_LENGTH + 1];
-    snprintf(_id, sizeof(_id), "%.*s", tokens[id_index].end - tokens[id_index].start, request->body.contents + tokens[id_index].start);
+    return responseAllocWithFormat(415, "Unsupported Media Type", "application/json", "{ \"status\": 415, \"message\": \"Only accepts content type application/json, not %s\" }", contentTypeHeader->value.contents);
+  }
 
-    char buffer[1024];
-    int found = delete_one_document(_id);
-    struct Response *response;
-    if (found == 0)
-    {
-      response = responseAllocWithFormat(200, "OK", "application/json", "{ \"status\": 200, \"message\": \"Document deleted\"}");
-    }
-    else
-    {
-      response = responseAllocWithFormat(404, "Not found", "application/json", "{ \"status\": 404, \"message\": \"No document found\"}");
-    }
-    response->extraHeaders = strdup(corsHeaders);
-    return response;
+  // Bodies with more structure than fits on the stack get their tokens counted and allocated
+  jsmntok_t stack_tokens[STACK_TOKENS];
+  jsmntok_t *tokens = stack_tokens;
+  int capacity = STACK_TOKENS;
+  int num_tokens = parse_json_tokens(request->body.contents, request->body.length, &tokens, &capacity);
+  struct Response *response = createResponseForJSONRequest(collection, request, route, tokens, num_tokens);
+  if (tokens != stack_tokens)
+  {
+    free(tokens);
   }
+  return response;
+}
 
-  // Unknown path
-  char *json_escaped_path = escape_json_string(request->pathDecoded);
-  struct Response *response = responseAllocWithFormat(404, "Not found", "application/json", "{ \"status\": 404, \"message\": \"Non-existing path: %s\"}", json_escaped_path);
-  free(json_escaped_path);
-  response->extraHeaders = strdup(corsHeaders);
+struct Response *createResponseForRequest(const struct Request *request, struct Connection *connection)
+{
+  uint64_t start = monotonic_nanoseconds();
+  // /c/<name>/documents/insertOne is /documents/insertOne on the collection <name>
+  const char *path = request->pathDecoded;
+  ddb_collection *collection = default_collection;
+  const char *name = NULL;
+  const char *name_end;
+  if (0 == strncmp(path, "/c/", 3) && (name_end = strchr(path + 3, '/')) != NULL)
+  {
+    name = path + 3;
+    path = name_end;
+  }
+  const ddb_route *route = route_lookup(path);
+  if (name != NULL && !collection_name_is_valid(name, name_end - name))
+  {
+    route = NULL;
+  }
+  else if (name != NULL)
+  {
+    // A router has no collections of its own, the shards create them. Routes that don't use the collection don't load it
+    collection = num_shards > 0 || route == NULL || route->missing_body == NULL ? NULL : collection_get(name, name_end - name, route->insert);
+  }
+  if (route != NULL && route->insert && collection != NULL)
+  {
+    collection = collection_insert_partition(collection, connection);
+  }
+  struct Response *response = createResponseForRoute(collection, request, route);
+  route_metrics_record(route, response->code, monotonic_nanoseconds() - start);
   return response;
 }
 